@@ -0,0 +1,42 @@
+<?php
+
+/*
+ * Recursive reducer passing a large array & an accumulator through every
+ * call - see "Example" in the README. Run it through run.sh to compare with
+ * & without the extension.
+ *
+ * Usage: php large_array.php [size] [runs]
+ */
+
+function collect($rest, $acc = []) {
+    if (!$rest) {
+        return $acc;
+    }
+
+    $acc[] = array_pop($rest) * 2;
+
+    return collect($rest, $acc);
+}
+
+$size = (int) ($argv[1] ?? 1000000);
+$runs = (int) ($argv[2] ?? 5);
+
+$input = range(1, $size);
+$best = INF;
+
+for ($i = 0; $i < $runs; $i++) {
+    $start = hrtime(true);
+
+    $result = collect($input);
+
+    $best = min($best, (hrtime(true) - $start) / 1e9);
+
+    if (count($result) !== $size) {
+        fwrite(STDERR, 'Unexpected result size: ' . count($result) . PHP_EOL);
+        exit(1);
+    }
+
+    unset($result);
+}
+
+printf("%d items, best of %d: %.4f seconds, %d bytes peak\n", $size, $runs, $best, memory_get_peak_usage());
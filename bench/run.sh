@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Runs large_array.php with & without the extension.
+#
+# Usage: bench/run.sh <path to tailcall .so> [size] [runs]
+#
+# (PHP_BIN can point at a specific php binary.)
+
+set -e
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <path to tailcall .so> [size] [runs]" >&2
+    exit 1
+fi
+
+PHP_BIN="${PHP_BIN:-php}"
+EXTENSION="$1"
+SCRIPT="$(dirname "$0")/large_array.php"
+
+shift
+
+# Without the extension, every iteration is a real frame - so it needs room.
+
+echo "Without extension:"
+"$PHP_BIN" -n -d memory_limit=-1 "$SCRIPT" "$@"
+
+echo "With extension:"
+"$PHP_BIN" -n -d memory_limit=-1 -d zend_extension="$EXTENSION" "$SCRIPT" "$@"
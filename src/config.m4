@@ -1,5 +1,5 @@
 PHP_ARG_ENABLE(tailcall, enable recursive tail call optimisation, no)
 
 if test "$PHP_TAILCALL" != "no"; then
-    PHP_NEW_EXTENSION(tailcall, tailcall.c, $ext_shared)
+    PHP_NEW_EXTENSION(tailcall, tailcall.c, $ext_shared,,,,yes)
 fi
\ No newline at end of file
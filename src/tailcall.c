@@ -2,34 +2,166 @@
 #include <stdbool.h>
 #include "php.h"
 #include "zend_extensions.h"
+#include "zend_attributes.h"
+#include "zend_observer.h"
+#if PHP_VERSION_ID >= 80100
+    #include "zend_fibers.h"
+#endif
 #include "tailcall.h"
 
 /*
- * Creates a new optimisation context.
- *
- * (In practice, the context is just a container for all relevant data.)
+ * The explicit stack (shared by every function using it) for the current
+ * request - plus one for each fiber that's used it (see tco_get_frames).
  */
-tco_context *tco_new_context(zend_op_array *op_array)
+
+ZEND_TLS tco_frame_stack tco_frames;
+ZEND_TLS HashTable *tco_fiber_frames = NULL;
+
+/* Whatever was handling ZEND_TICKS before we came along (if anything). */
+
+static user_opcode_handler_t tco_previous_ticks_handler = NULL;
+
+/* Which op_array->reserved slot is ours (for tiered mode). */
+
+static int tco_resource_handle = -1;
+
+/* The shadow frames recorded so far in the current request. */
+
+ZEND_TLS tco_shadow_ring tco_shadow;
+
+/* Whatever was creating exceptions & handling debug_backtrace() before us. */
+
+static zend_object *(*tco_previous_exception_new)(zend_class_entry *class_type) = NULL;
+static zend_object *(*tco_previous_error_exception_new)(zend_class_entry *class_type) = NULL;
+static zif_handler tco_previous_debug_backtrace = NULL;
+
+/* The compilation unit (i.e. file) currently being compiled, if any - plus whatever was compiling files before us. */
+
+ZEND_TLS tco_unit tco_current_unit;
+static zend_op_array *(*tco_previous_compile_file)(zend_file_handle *file_handle, int type) = NULL;
+
+/*
+ * Frees the memory allocated for each call's meta data - leaving just the
+ * (empty) pool.
+ */
+void tco_release_call_meta(tco_context *context)
 {
+    tco_call_meta *next_meta;
     tco_call_meta *call_meta;
 
-    tco_context *context = malloc(sizeof(tco_context));
+    next_meta = context->call_meta_tail;
+
+    while (next_meta) {
+        call_meta = next_meta;
+
+        // Free any memory allocated for additional opcodes.
+
+        if (call_meta->arg_mapping) {
+            free(call_meta->arg_mapping);
+            free(call_meta->arg_types);
+            free(call_meta->arg_moves);
+            free(call_meta->arg_stages);
+        }
+
+        if (call_meta->inline_ops) {
+            free(call_meta->inline_ops);
+        }
+
+        // Save pointer to the next (technically previous) structure.
+
+        next_meta = call_meta->previous;
+
+        // If this structure was dynamically allocated, free it.
+
+        if (call_meta->number > TCO_CALL_POOL_SIZE) {
+            free(call_meta);
+        }
+    }
+
+    // Point back to the start of the pool - which is free again.
+
+    call_meta = context->call_meta_tail = context->call_meta_pool;
+
+    call_meta->number = 1;
+    call_meta->previous = NULL;
+    call_meta->arg_mapping = NULL;
+    call_meta->inline_ops = NULL;
+}
+
+/*
+ * Gets a context ready for a given op array - which may not be the first
+ * it's been used for (see tco_get_context). Anything to do with the last op
+ * array's calls is let go of, but scratch buffers are kept for reuse.
+ */
+void tco_reset_context(tco_context *context, zend_op_array *op_array)
+{
+    tco_release_call_meta(context);
+
+    if (context->reentry_stages) {
+        free(context->reentry_stages);
+    }
 
     context->do_compile = false;
     context->op_array = op_array;
-    context->t_remaps = NULL;
+    context->t_remaps_reserved = false;
     context->start_address = 0;
     context->total_extra_ops = 0;
+    context->stack_cv = 0;
+    context->inline_calls = (TCO_INLINE_MAX_OPS > 0);
+    context->reentry_stages = NULL;
+    context->reentry_holds = NULL;
+    context->reentry_count = 0;
+    context->reentry_address = 0;
+    context->reentry_host = NULL;
+    context->shadow_cv = 0;
+}
+
+/*
+ * Makes sure a scratch buffer can hold at least a given number of items -
+ * growing it (to at least double its size) if not. Returns the buffer.
+ */
+void *tco_grow_buffer(void *buffer, uint32_t *size, uint32_t required, size_t item_size)
+{
+    if (required > *size) {
+        *size = MAX(required, *size * 2);
+
+        buffer = realloc(buffer, item_size * (*size));
+    }
+
+    return buffer;
+}
+
+/*
+ * Creates a new optimisation context.
+ *
+ * (In practice, the context is just a container for all relevant data.)
+ */
+tco_context *tco_new_context(zend_op_array *op_array)
+{
+    tco_context *context = malloc(sizeof(tco_context));
+
+    // Scratch buffers start off empty & grow as needed (see tco_grow_buffer).
+
+    context->t_remaps = NULL;
+    context->t_remaps_count = 0;
+    context->call_sites = NULL;
+    context->call_sites_size = 0;
+    context->open_inits = NULL;
+    context->open_inits_size = 0;
+    context->reentry_stages = NULL;
 
     // Allocate enough memory for the call meta pool & point to the tail.
 
-    call_meta = context->call_meta_tail = malloc(sizeof(tco_call_meta) * TCO_CALL_POOL_SIZE);
+    context->call_meta_pool = context->call_meta_tail = malloc(sizeof(tco_call_meta) * TCO_CALL_POOL_SIZE);
 
     // We need to set some initial values for the first call meta structure.
 
-    call_meta->number = 1;
-    call_meta->previous = NULL;
-    call_meta->arg_mapping = NULL;
+    context->call_meta_pool->number = 1;
+    context->call_meta_pool->previous = NULL;
+    context->call_meta_pool->arg_mapping = NULL;
+    context->call_meta_pool->inline_ops = NULL;
+
+    tco_reset_context(context, op_array);
 
     // (Have a guess what this does.)
 
@@ -41,8 +173,10 @@ tco_context *tco_new_context(zend_op_array *op_array)
  *
  * If a structure is free within the pool, it will be used.
  * Otherwise, a new one will be dynamically allocated on-the-fly.
+ *
+ * (num_args is the number of arguments of the function being called.)
  */
-tco_call_meta *tco_get_new_call_meta(tco_context *context)
+tco_call_meta *tco_get_new_call_meta(tco_context *context, uint32_t num_args)
 {
     tco_call_meta *current_meta;
     tco_call_meta *new_meta;
@@ -57,7 +191,9 @@ tco_call_meta *tco_get_new_call_meta(tco_context *context)
         // Here we can either use the next free structure or allocate a new one.
 
         if (current_meta->number < TCO_CALL_POOL_SIZE) {
-           new_meta = context->call_meta_tail + current_meta->number;
+            // (The pool's structures sit side by side, so the next one is right after this one.)
+
+            new_meta = current_meta + 1;
         } else {
             // (Maybe allocating a new pool would be better?)
 
@@ -77,7 +213,25 @@ tco_call_meta *tco_get_new_call_meta(tco_context *context)
 
     // This array will be used to map arguments to their respective T vars.
 
-    new_meta->arg_mapping = calloc(context->op_array->num_args, sizeof(uint32_t));
+    new_meta->arg_mapping = calloc(num_args, sizeof(uint32_t));
+
+    // (Zero being IS_UNUSED means every argument starts off as not passed.)
+
+    new_meta->arg_types = calloc(num_args, sizeof(zend_uchar));
+    new_meta->arg_moves = calloc(num_args, sizeof(zend_uchar));
+    new_meta->arg_stages = calloc(num_args, sizeof(uint32_t));
+    new_meta->move_count = 0;
+    new_meta->init_index = 0;
+    new_meta->reentry_jump = 0;
+    new_meta->inline_ops = NULL;
+    new_meta->inline_count = 0;
+
+    // Calls don't push an explicit stack frame unless told otherwise.
+
+    new_meta->push_frame = false;
+    new_meta->frame_layout = TCO_NO_LAYOUT;
+    new_meta->result_type = IS_UNUSED;
+    new_meta->result_var = 0;
 
     // Return t'structure.
 
@@ -92,40 +246,28 @@ void tco_free_context(tco_context *context)
 {
     // Free any additional memory allocated for call meta outside of the pool.
 
-    tco_call_meta *next_meta;
-    tco_call_meta *call_meta;
-
-    next_meta = context->call_meta_tail;
-
-    while (next_meta) {
-        call_meta = next_meta;
-
-        // Free any memory allocated for additional opcodes.
-
-        if (call_meta->arg_mapping) {
-            free(call_meta->arg_mapping);
-        }
+    tco_release_call_meta(context);
 
-        // Save pointer to the next (technically previous) structure.
+    // Free the memory allocated for the pool itself.
 
-        next_meta = call_meta->previous;
+    free(context->call_meta_pool);
 
-        // If this structure was dynamically allocated, free it.
+    // Free the scratch buffers.
 
-        if (call_meta->number > TCO_CALL_POOL_SIZE) {
-            free(call_meta);
-        }
+    if (context->t_remaps) {
+        free(context->t_remaps);
     }
 
-    // Free the memory allocated for the pool itself.
-    // (By now, call_meta should be pointing to it.)
-
-    free(call_meta);
+    if (context->call_sites) {
+        free(context->call_sites);
+    }
 
-    // Free any memory allocated for T var remaps.
+    if (context->open_inits) {
+        free(context->open_inits);
+    }
 
-    if (context->t_remaps) {
-        free(context->t_remaps);
+    if (context->reentry_stages) {
+        free(context->reentry_stages);
     }
 
     // (We need to free any Zend strings/vars here somewhere eventually.)
@@ -162,158 +304,526 @@ inline void tco_make_jmp(zend_op *op, uint32_t address)
 }
 
 /*
- * Updates the given context with rewritten opcodes.
+ * Converts a given opcode to a "push frame" for the explicit stack.
+ *
+ * Operand 1 is the frame's layout (see tco_plan_frame_layout), which includes
+ * the address to resume from once the call returns; operand 2 is the hidden
+ * depth CV; the result is wherever the call's result used to go.
  */
-void tco_compile_opcodes(tco_context *context)
+void tco_make_push_frame(zend_op *op, tco_call_meta *call_meta, uint32_t stack_cv)
 {
-    zend_op *op;
-    zend_op *opcodes;
-    zend_op *end_address;
-
-    zend_op_array *op_array = context->op_array;
+    op->opcode = ZEND_TICKS;
+    op->extended_value = TCO_OPLINE_PUSH_FRAME;
 
-    tco_call_meta *call_meta = context->call_meta_tail;
+    op->op1_type = IS_CONST;
+    op->op1.constant = call_meta->frame_layout;
 
-    uint32_t appendix_offset = op_array->last;
+    op->op2_type = IS_CV;
+    op->op2.var = stack_cv;
 
-    /*
-     * If we require additional opcodes, we'll have to allocate enough new
-     * memory for the old opcodes & the new; copy the old opcodes; free
-     * the old memory; update the pointer in the op array; and update
-     * op_array->last to account for the new opcodes.
-     */
+    op->result_type = call_meta->result_type;
+    op->result.var = call_meta->result_var;
+}
 
-    if (context->total_extra_ops > 0) {
-        opcodes = emalloc(
-            sizeof(zend_op) * (op_array->last + context->total_extra_ops)
-        );
+/*
+ * Converts a given return opcode to a "pop frame" for the explicit stack.
+ *
+ * Operand 1 (the return value) is left untouched - so that when there's no
+ * frame to pop, the opcode can just be treated as the original return.
+ */
+void tco_make_pop_frame(zend_op *op, uint32_t stack_cv)
+{
+    op->opcode = ZEND_TICKS;
+    op->extended_value = TCO_OPLINE_POP_FRAME;
 
-        memcpy(
-            opcodes,
-            op_array->opcodes,
-            sizeof(zend_op) * op_array->last
-        );
+    op->op2_type = IS_CV;
+    op->op2.var = stack_cv;
+}
 
-    	efree(op_array->opcodes);
+/*
+ * Converts a given opcode to a "record shadow frame" (see TCO_SHADOW_FRAMES).
+ *
+ * Operand 2 is the hidden serial CV - everything else it needs (the line &
+ * the arguments) is already at hand.
+ */
+void tco_make_shadow_frame(zend_op *op, uint32_t shadow_cv)
+{
+    op->opcode = ZEND_TICKS;
+    op->extended_value = TCO_OPLINE_SHADOW_FRAME;
 
-        op_array->opcodes = opcodes;
+    op->op2_type = IS_CV;
+    op->op2.var = shadow_cv;
+}
 
-        op_array->last += context->total_extra_ops;
-    } else {
-        opcodes = op_array->opcodes;
+/*
+ * Returns the index of the argument held in a given CV - or num_args if the
+ * CV isn't an argument at all.
+ */
+uint32_t tco_find_arg_cv(zend_op_array *op_array, uint32_t var)
+{
+    for (uint32_t i = 0; i < op_array->num_args; i++) {
+        if (TCO_ARG_RECV_OPCODE(op_array, i).result.var == var) {
+            return i;
+        }
     }
 
-    /*
-     * Now we'll need to update the opcodes for each recursive tail call.
-     *
-     * Here we'll iterate over every argument for the function.
-     * If the arg is mapped to a T var, we'll create an assignment of that
-     * T var, to that argument's variable.
-     * Otherwise, we'll create an assignment of that argument's default value.
-     *
-     * e.g. If an opcode was trying to pass T4 as the first argument - and
-     * the first argument is referred to using the variable $a - then
-     * this will instead just assign T4 to $a.
-     *
-     * If the function has another argument referred to by the variable $b - and
-     * no opcodes passed any values as the second argument - and $b has a default
-     * value of 200 - then instead we'll create an assignment of the constant
-     * value 200, to $b.
-     *
-     * The earlier T var remapping should have ensured that each T var will
-     * still have the appropriate/original/relevant value by the time we get here.
-     *
-     * In terms of where these opcodes get written to: we know that there may be
-     * spare opcodes - so we'll use as many as we can. After that, we'll
-     * write to the newly-allocated memory. Jumps will also be inserted as
-     * appropriate to tie this all together.
-     */
+    return op_array->num_args;
+}
 
-    call_meta = context->call_meta_tail;
+/*
+ * Determines whether a CV passed as the given argument was also passed as an
+ * earlier argument.
+ */
+bool tco_is_cv_passed_earlier(tco_call_meta *call_meta, uint32_t arg_index)
+{
+    for (uint32_t i = 0; i < arg_index; i++) {
+        if (
+            (call_meta->arg_types[i] == IS_CV)
+            && (call_meta->arg_mapping[i] == call_meta->arg_mapping[arg_index])
+        ) {
+            return true;
+        }
+    }
 
-    while (call_meta) {
-        op = opcodes + call_meta->spare_start_index;
-        end_address = opcodes + call_meta->spare_last_index;
+    return false;
+}
 
-        // Loop over each argument.
+/*
+ * Initialises an opcode to a given opcode - with everything else unused.
+ */
+void tco_init_op(zend_op *op, zend_uchar opcode, uint32_t lineno)
+{
+    memset(op, 0x00, sizeof(zend_op));
 
-        for (uint32_t arg_index = 0; arg_index < op_array->num_args; arg_index++) {
-            // We'll check the op pointer against end_address to make sure
-            // we're writing to the right place (if end_address is set).
+    op->opcode = opcode;
+    op->lineno = lineno;
 
-            if (
-                end_address
-                && (op >= end_address)
-            ) {
-                // Add a jump at the end address, to where the remaining opcodes will be.
+    SET_UNUSED(op->op1);
+    SET_UNUSED(op->op2);
+    SET_UNUSED(op->result);
+}
 
-                tco_make_jmp(end_address, appendix_offset);
+/*
+ * Writes the opcodes needed to move a call's arguments into place (as
+ * planned by tco_plan_arg_moves) - preceded by a frame push, if needed.
+ *
+ * (Pushing a frame moves the CVs out of the way - so for those calls, the
+ * staging happens before the push.)
+ *
+ * Returns the number of opcodes written.
+ */
+uint32_t tco_build_moves(tco_context *context, tco_call_meta *call_meta, zend_op *moves, uint32_t lineno)
+{
+    zend_op_array *op_array = context->op_array;
 
-                // Point now to the additional memory allocated at the end.
+    zend_op *op = moves;
 
-                op = opcodes + appendix_offset;
+    uint32_t arg_index;
 
-                // We can also calculate at this point how many opcodes will be
-                // added to the appendix - so we can update that for the next call.
+    // Tail calls can leave a note of each iteration behind, if asked to.
 
-                appendix_offset += (op_array->num_args - arg_index);
+    if (context->shadow_cv && !call_meta->push_frame) {
+        tco_init_op(op, ZEND_TICKS, lineno);
+        tco_make_shadow_frame(op++, context->shadow_cv);
+    }
 
-                // (This is a bit of a hack, but my brain is tired.)
+    // Anything that needs staging has to be copied before any assignments happen.
 
-                end_address = NULL;
-            }
+    for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+        if (call_meta->arg_moves[arg_index] != TCO_MOVE_STAGED) {
+            continue;
+        }
 
-            // Initialise the opcode to an assignment to this argument's variable.
+        tco_init_op(op, ZEND_QM_ASSIGN, lineno);
 
-            op->opcode = ZEND_ASSIGN;
+        op->op1_type = IS_CV;
+        op->op1.var = call_meta->arg_mapping[arg_index];
 
-            op->op1_type = IS_CV;
-            op->op1.var = TCO_ARG_RECV_OPCODE(op_array, arg_index).result.var;
+        op->result_type = IS_TMP_VAR;
+        op->result.var = call_meta->arg_stages[arg_index];
 
-            SET_UNUSED(op->result);
+        ++op;
+    }
 
-            // Set the 2nd operand to either the appropriate T var or the default constant.
+    // Non-tail calls need to save the caller's state before the arguments get overwritten.
 
-            if (call_meta->arg_mapping[arg_index]) {
-                op->op2_type = IS_TMP_VAR;
-                op->op2.var = call_meta->arg_mapping[arg_index];
-            } else {
-                op->op2_type = IS_CONST;
-                op->op2.constant = TCO_ARG_RECV_OPCODE(op_array, arg_index).op2.constant;
-            }
+    if (call_meta->push_frame) {
+        tco_init_op(op, ZEND_TICKS, lineno);
+        tco_make_push_frame(op++, call_meta, context->stack_cv);
+    }
 
-            // Increment the pointer.
+    // Now the assignments themselves.
 
-            ++op;
+    for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+        if (call_meta->arg_moves[arg_index] == TCO_MOVE_NONE) {
+            continue;
         }
 
-        // At this point, we'll add a jump where ever op is currently pointing to.
+        // Initialise the opcode to an assignment to this argument's variable.
 
-        tco_make_jmp(op, context->start_address);
+        tco_init_op(op, ZEND_ASSIGN, lineno);
 
-        // (This isn't strictly necessary, but we'll nop out any remaining spares.)
+        op->op1_type = IS_CV;
+        op->op1.var = TCO_ARG_RECV_OPCODE(op_array, arg_index).result.var;
 
-        if (end_address) {
-            // At this point, op will be pointing to the jump we just added - so
-            // we need to increment past it.
+        // Set the 2nd operand to either whatever was passed, the stage or the default constant.
 
-            for (++op; op <= end_address; op++) {
-                tco_nop_out(op);
-            }
-        }
+        switch (call_meta->arg_moves[arg_index]) {
+            case TCO_MOVE_ASSIGN:
+                op->op2_type = call_meta->arg_types[arg_index];
+                op->op2.var = call_meta->arg_mapping[arg_index];
 
-        // Point call_meta to the next (technically previous) structure.
+                break;
 
-        call_meta = call_meta->previous;
-    }
-}
+            case TCO_MOVE_STAGED:
+                op->op2_type = IS_TMP_VAR;
+                op->op2.var = call_meta->arg_stages[arg_index];
 
-/*
- * Determines whether a given init opcode is a recursive function call.
- */
-bool tco_is_call_recursive(zend_op_array *op_array, zend_op *op)
-{
-    // Make sure operand 2 is a constant.
+                break;
+
+            default:
+                op->op2_type = IS_CONST;
+                op->op2.constant = TCO_ARG_RECV_OPCODE(op_array, arg_index).op2.constant;
+        }
+
+        ++op;
+    }
+
+    // Finally, any local CVs that were passed are dead now - so let go of them.
+
+    for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+        if (
+            (call_meta->arg_moves[arg_index] != TCO_MOVE_ASSIGN)
+            || (call_meta->arg_types[arg_index] != IS_CV)
+            || (tco_find_arg_cv(op_array, call_meta->arg_mapping[arg_index]) != op_array->num_args)
+            || tco_is_cv_passed_earlier(call_meta, arg_index)
+        ) {
+            continue;
+        }
+
+        tco_init_op(op, ZEND_UNSET_CV, lineno);
+
+        op->op1_type = IS_CV;
+        op->op1.var = call_meta->arg_mapping[arg_index];
+
+        ++op;
+    }
+
+    return (uint32_t) (op - moves);
+}
+
+/*
+ * Writes a single copy of an argument (as passed to a given call) to a T var.
+ */
+void tco_make_stage(zend_op *op, zend_op_array *op_array, tco_call_meta *call_meta, uint32_t arg_index, uint32_t result_var, uint32_t lineno)
+{
+    tco_init_op(op, ZEND_QM_ASSIGN, lineno);
+
+    if (call_meta->arg_types[arg_index] == IS_UNUSED) {
+        op->op1_type = IS_CONST;
+        op->op1.constant = TCO_ARG_RECV_OPCODE(op_array, arg_index).op2.constant;
+    } else {
+        op->op1_type = call_meta->arg_types[arg_index];
+        op->op1.var = call_meta->arg_mapping[arg_index];
+    }
+
+    op->result_type = IS_TMP_VAR;
+    op->result.var = result_var;
+}
+
+/*
+ * Writes the opcodes for a call when there's a shared re-entry block (see
+ * tco_plan_reentry) - i.e. copying whatever the call changes into the
+ * block's T vars. The call chosen to host the block is followed by the
+ * block itself; the others will jump to it.
+ *
+ * Returns the number of opcodes written.
+ */
+uint32_t tco_build_shared_moves(tco_context *context, tco_call_meta *call_meta, zend_op *moves, uint32_t lineno)
+{
+    zend_op_array *op_array = context->op_array;
+
+    zend_op *op = moves;
+
+    uint32_t arg_index;
+
+    // (Calls pushing a frame never share a block - see tco_analyse.)
+
+    if (context->shadow_cv) {
+        tco_init_op(op, ZEND_TICKS, lineno);
+        tco_make_shadow_frame(op++, context->shadow_cv);
+    }
+
+    bool is_host = (call_meta == context->reentry_host);
+
+    /*
+     * At the host, values computed into a T var were already pointed at the
+     * block's T var, & anything else gets copied there.
+     *
+     * Anywhere else, the block's T vars get no live range (pass two only
+     * gives a T var one from where it's set to a later use - & the block
+     * isn't later) - so anything left in them would leak if an exception
+     * were thrown before the jump. So there, they're only filled right at
+     * the end - with CVs held in T vars of their own until then (copying an
+     * undefined CV warns, which a handler could turn into an exception).
+     */
+
+    for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+        if (call_meta->arg_moves[arg_index] != TCO_MOVE_STAGED) {
+            continue;
+        }
+
+        if (is_host) {
+            tco_make_stage(op++, op_array, call_meta, arg_index, context->reentry_stages[arg_index], lineno);
+        } else if (call_meta->arg_types[arg_index] == IS_CV) {
+            tco_make_stage(op++, op_array, call_meta, arg_index, context->reentry_holds[arg_index], lineno);
+        }
+    }
+
+    // Local CVs are dead now (same as tco_build_moves).
+
+    for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+        if (
+            (call_meta->arg_types[arg_index] != IS_CV)
+            || (tco_find_arg_cv(op_array, call_meta->arg_mapping[arg_index]) != op_array->num_args)
+            || tco_is_cv_passed_earlier(call_meta, arg_index)
+        ) {
+            continue;
+        }
+
+        tco_init_op(op, ZEND_UNSET_CV, lineno);
+
+        op->op1_type = IS_CV;
+        op->op1.var = call_meta->arg_mapping[arg_index];
+
+        ++op;
+    }
+
+    // (Nothing from here on can throw.)
+
+    if (!is_host) {
+        for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+            if (call_meta->arg_moves[arg_index] != TCO_MOVE_STAGED) {
+                continue;
+            }
+
+            tco_make_stage(op, op_array, call_meta, arg_index, context->reentry_stages[arg_index], lineno);
+
+            if (call_meta->arg_types[arg_index] == IS_CV) {
+                op->op1_type = IS_TMP_VAR;
+                op->op1.var = context->reentry_holds[arg_index];
+            }
+
+            ++op;
+        }
+    }
+
+    // And finally, the block itself.
+
+    if (is_host) {
+        for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+            if (context->reentry_stages[arg_index] == TCO_NO_STAGE) {
+                continue;
+            }
+
+            tco_init_op(op, ZEND_ASSIGN, lineno);
+
+            op->op1_type = IS_CV;
+            op->op1.var = TCO_ARG_RECV_OPCODE(op_array, arg_index).result.var;
+
+            op->op2_type = IS_TMP_VAR;
+            op->op2.var = context->reentry_stages[arg_index];
+
+            ++op;
+        }
+    }
+
+    return (uint32_t) (op - moves);
+}
+
+/*
+ * Updates the given context with rewritten opcodes.
+ */
+void tco_compile_opcodes(tco_context *context)
+{
+    zend_op *op;
+    zend_op *opcodes;
+    zend_op *end_address;
+
+    zend_op_array *op_array = context->op_array;
+
+    tco_call_meta *call_meta = context->call_meta_tail;
+
+    zend_op *moves;
+    uint32_t move_count;
+
+    uint32_t appendix_offset = op_array->last;
+
+    /*
+     * If we require additional opcodes, we'll have to allocate enough new
+     * memory for the old opcodes & the new; copy the old opcodes; free
+     * the old memory; update the pointer in the op array; and update
+     * op_array->last to account for the new opcodes.
+     */
+
+    if (context->total_extra_ops > 0) {
+        opcodes = emalloc(
+            sizeof(zend_op) * (op_array->last + context->total_extra_ops)
+        );
+
+        memcpy(
+            opcodes,
+            op_array->opcodes,
+            sizeof(zend_op) * op_array->last
+        );
+
+    	efree(op_array->opcodes);
+
+        op_array->opcodes = opcodes;
+
+        op_array->last += context->total_extra_ops;
+    } else {
+        opcodes = op_array->opcodes;
+    }
+
+    /*
+     * Now we'll need to update the opcodes for each recursive tail call.
+     *
+     * Here we'll iterate over every argument for the function.
+     * If the arg is mapped to a variable, we'll create an assignment of that
+     * variable, to that argument's variable (see tco_build_moves).
+     * Otherwise, we'll create an assignment of that argument's default value.
+     *
+     * e.g. If an opcode was trying to pass T4 as the first argument - and
+     * the first argument is referred to using the variable $a - then
+     * this will instead just assign T4 to $a.
+     *
+     * If the function has another argument referred to by the variable $b - and
+     * no opcodes passed any values as the second argument - and $b has a default
+     * value of 200 - then instead we'll create an assignment of the constant
+     * value 200, to $b.
+     *
+     * The earlier T var remapping should have ensured that each T var will
+     * still have the appropriate/original/relevant value by the time we get here.
+     *
+     * In terms of where these opcodes get written to: we know that there may be
+     * spare opcodes - so we'll use as many as we can. After that, we'll
+     * write to the newly-allocated memory. Jumps will also be inserted as
+     * appropriate to tie this all together.
+     */
+
+    call_meta = context->call_meta_tail;
+
+    while (call_meta) {
+        op = opcodes + call_meta->spare_start_index;
+        end_address = opcodes + call_meta->spare_last_index;
+
+        // Build the opcodes for this call first - then worry about where they go.
+
+        if (call_meta->inline_ops) {
+            moves = call_meta->inline_ops;
+            move_count = call_meta->inline_count;
+        } else if (context->reentry_stages) {
+            moves = malloc(sizeof(zend_op) * (call_meta->move_count + 1));
+            move_count = tco_build_shared_moves(context, call_meta, moves, op->lineno);
+        } else {
+            moves = malloc(sizeof(zend_op) * (call_meta->move_count + 1));
+            move_count = tco_build_moves(context, call_meta, moves, op->lineno);
+        }
+
+        for (uint32_t move_index = 0; move_index < move_count; move_index++) {
+            // We'll check the op pointer against end_address to make sure
+            // we're writing to the right place (if end_address is set).
+
+            // (Inlined code has no jump back - so its last opcode can go at the end address.)
+
+            if (
+                end_address
+                && (op >= end_address)
+                && (!call_meta->inline_ops || (move_index + 1 < move_count))
+            ) {
+                // Add a jump at the end address, to where the remaining opcodes will be.
+
+                tco_make_jmp(end_address, appendix_offset);
+
+                // Point now to the additional memory allocated at the end.
+
+                op = opcodes + appendix_offset;
+
+                // We can also calculate at this point how many opcodes will be
+                // added to the appendix (the remaining moves, plus the jump
+                // back) - so we can update that for the next call.
+
+                appendix_offset += (move_count - move_index) + (call_meta->inline_ops ? 0 : 1);
+
+                // (This is a bit of a hack, but my brain is tired.)
+
+                end_address = NULL;
+            }
+
+            // (The shared re-entry block is the last reentry_count opcodes of its host.)
+
+            if (
+                (call_meta == context->reentry_host)
+                && (move_index == move_count - context->reentry_count)
+            ) {
+                context->reentry_address = (uint32_t) (op - opcodes);
+            }
+
+            *op = moves[move_index];
+
+            // Increment the pointer.
+
+            ++op;
+        }
+
+        // At this point, we'll add a jump where ever op is currently pointing to.
+        // (Unless the call was inlined - that ends with a return of its own.)
+
+        if (!call_meta->inline_ops) {
+            free(moves);
+
+            // (Calls sharing a re-entry block jump there instead - but where it'll be
+            // isn't known until its host has been written, so that's patched later.)
+
+            if (
+                context->reentry_stages
+                && (call_meta != context->reentry_host)
+            ) {
+                call_meta->reentry_jump = (uint32_t) (op - opcodes);
+            }
+
+            tco_make_jmp(op++, context->start_address);
+        }
+
+        // (This isn't strictly necessary, but we'll nop out any remaining spares.)
+
+        if (end_address) {
+            for (; op <= end_address; op++) {
+                tco_nop_out(op);
+            }
+        }
+
+        // Point call_meta to the next (technically previous) structure.
+
+        call_meta = call_meta->previous;
+    }
+
+    // Now the shared re-entry block has been written, point everything at it.
+
+    for (call_meta = context->call_meta_tail; call_meta; call_meta = call_meta->previous) {
+        if (call_meta->reentry_jump) {
+            opcodes[call_meta->reentry_jump].op1.opline_num = context->reentry_address;
+        }
+    }
+}
+
+/*
+ * Determines whether a given init opcode is a recursive function call.
+ */
+bool tco_is_call_recursive(zend_op_array *op_array, zend_op *op)
+{
+    // Make sure operand 2 is a constant.
 
     if (op->op2_type != IS_CONST) {
         return false;
@@ -395,22 +905,31 @@ bool tco_is_call_recursive(zend_op_array *op_array, zend_op *op)
 
 /*
  * Returns an array for tracking T var remaps.
+ *
+ * Unless told not to, room is also reserved for the remapped T vars. (Calls
+ * using the explicit stack don't need it - every T var makes each frame of
+ * the function bigger.)
  */
-uint32_t *tco_get_t_remaps(tco_context *context)
+uint32_t *tco_get_t_remaps(tco_context *context, bool reserve)
 {
     // Each existing T variable will potentially need its own remap.
 
     size_t bytes_required = sizeof(uint32_t) * context->op_array->T;
 
-    // If remaps haven't already been allocated, we need to allocate 'em.
+    // The remaps may be left over from an earlier op array (or call) - so
+    // they only need (re)allocating if there's not enough of them.
 
-    if (!context->t_remaps) {
-        context->t_remaps = (uint32_t *) malloc(bytes_required);
+    if (context->op_array->T > context->t_remaps_count) {
+        context->t_remaps = (uint32_t *) realloc(context->t_remaps, bytes_required);
+        context->t_remaps_count = context->op_array->T;
+    }
 
+    if (reserve && !context->t_remaps_reserved) {
         // While we're here, we should probably update T to reflect the new (expected) number.
         // (This may make more sense done elsewhere, but it's here for now at least.)
 
         context->op_array->T += context->op_array->T;
+        context->t_remaps_reserved = true;
     }
 
     // (We also need to intialise everything to zero.)
@@ -441,10 +960,8 @@ inline void tco_do_operand_remaps(zend_uchar type, znode_op operand, uint32_t *t
  * In theory, there should never be any situation in which this would
  * fail to find a value.
  */
-uint32_t tco_find_named_arg(zend_string *arg_name, tco_context *context)
+uint32_t tco_find_named_arg(zend_string *arg_name, zend_op_array *op_array)
 {
-    zend_op_array *op_array = context->op_array;
-
     for (uint32_t i = 0; i < op_array->num_args; i++) {
         if (zend_string_equals(op_array->arg_info[i].name, arg_name)) {
             return i;
@@ -457,49 +974,367 @@ uint32_t tco_find_named_arg(zend_string *arg_name, tco_context *context)
 }
 
 /*
- * This function will analyse the opcodes for a given [...]
+ * Works out how each argument of a call should be moved into place - and
+ * returns the number of opcodes that'll take.
  *
- * The general idea here is:
+ * The aim is to avoid touching refcounts where possible, so that arrays &
+ * strings being passed through the recursion (e.g. accumulators) aren't
+ * separated every iteration:
  *
- * - Identify which T vars need to be preserved (i.e. those passed as arguments).
- * - Track how much additional space will eventually be needed for the modified opcodes.
+ * - An argument passed as itself (f($acc) for $acc) needs nothing at all.
+ * - T vars are moved by the assignment anyway.
+ * - A local CV is dead once the tail call's been made - so after it's been
+ *   assigned, it's unset (leaving the argument as the only reference).
+ * - An argument passed as another argument is fine - unless that other
+ *   argument is assigned first (e.g. f($b, $a)), in which case it has to be
+ *   copied to a T var before any assignments are made.
  *
- * (Not necessarily in that order.)
+ * Calls pushing a frame are different: the push moves every CV into the
+ * frame, so any CV passed has to be copied to a T var beforehand.
  */
-void tco_optimise_recursive_call(
-    tco_context *context,
-    uint32_t init_index,
-    uint32_t return_index
-) {
-    zend_op *op;
-
-    uint32_t arg_index;
+uint32_t tco_plan_arg_moves(tco_context *context, tco_call_meta *call_meta)
+{
+    uint32_t source_index;
 
     zend_op_array *op_array = context->op_array;
 
-    // Flag the context as having been optimised, requiring compilation, etc.
+    uint32_t move_count = 0;
 
-    context->do_compile = true;
+    // (Recording a shadow frame counts as a move - see tco_build_moves.)
 
-    // This will get/allocate a structure for storing meta data for the call.
+    if (context->shadow_cv && !call_meta->push_frame) {
+        move_count++;
+    }
 
-    tco_call_meta *call_meta = tco_get_new_call_meta(context);
+    for (uint32_t arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+        if (call_meta->arg_types[arg_index] == IS_UNUSED) {
+            call_meta->arg_moves[arg_index] = TCO_MOVE_DEFAULT;
+            move_count++;
 
-    // At some point we'll need to know how many arguments were passed.
-    // (This will be updated as various send opcodes are encountered.)
+            continue;
+        }
 
-    uint32_t args_passed_count = 0;
+        call_meta->arg_moves[arg_index] = TCO_MOVE_ASSIGN;
+        move_count++;
 
-    // T variable (re)mapping.
+        if (call_meta->arg_types[arg_index] != IS_CV) {
+            continue;
+        }
 
-    uint32_t *t_remaps = tco_get_t_remaps(context);
+        if (call_meta->push_frame) {
+            call_meta->arg_moves[arg_index] = TCO_MOVE_STAGED;
+            call_meta->arg_stages[arg_index] = op_array->T++;
+            move_count++;
 
-    // This is used to track the next available (newly-created) T var.
-    // (op_array->T itself will be updated elsewhere.)
+            continue;
+        }
 
-    uint32_t next_free_t_var = op_array->T;
+        source_index = tco_find_arg_cv(op_array, call_meta->arg_mapping[arg_index]);
 
-    /*
+        if (source_index == arg_index) {
+            call_meta->arg_moves[arg_index] = TCO_MOVE_NONE;
+            move_count--;
+        } else if (source_index == op_array->num_args) {
+            // (Only 1 unset per local, however many times it's passed.)
+
+            if (!tco_is_cv_passed_earlier(call_meta, arg_index)) {
+                move_count++;
+            }
+        } else if (
+            (source_index < arg_index)
+            && (call_meta->arg_moves[source_index] != TCO_MOVE_NONE)
+        ) {
+            call_meta->arg_moves[arg_index] = TCO_MOVE_STAGED;
+            call_meta->arg_stages[arg_index] = op_array->T++;
+            move_count++;
+        }
+    }
+
+    call_meta->move_count = move_count;
+
+    return move_count;
+}
+
+/*
+ * Returns the CV with a given name, adding it to the op array if it doesn't
+ * exist yet. (The name is released if it's already there.)
+ */
+uint32_t tco_add_cv(zend_op_array *op_array, zend_string *name)
+{
+    for (uint32_t i = 0; i < op_array->last_var; i++) {
+        if (zend_string_equals(op_array->vars[i], name)) {
+            zend_string_release(name);
+
+            return (uint32_t) (zend_uintptr_t) ZEND_CALL_VAR_NUM(NULL, i);
+        }
+    }
+
+    op_array->vars = erealloc(op_array->vars, sizeof(zend_string *) * (op_array->last_var + 1));
+    op_array->vars[op_array->last_var] = name;
+
+    // (T vars haven't been converted to offsets yet, so they'll shift along by themselves.)
+
+    return (uint32_t) (zend_uintptr_t) ZEND_CALL_VAR_NUM(NULL, op_array->last_var++);
+}
+
+/*
+ * Adds a copy of a given value to the op array's literals & returns its index.
+ */
+uint32_t tco_add_literal(zend_op_array *op_array, zval *value)
+{
+    op_array->literals = erealloc(op_array->literals, sizeof(zval) * (op_array->last_literal + 1));
+
+    ZVAL_COPY(&op_array->literals[op_array->last_literal], value);
+
+    return op_array->last_literal++;
+}
+
+/*
+ * Remaps an operand of an opcode copied out of an inlined callee, so that it
+ * refers to the caller's variables & literals instead.
+ *
+ * The callee has already been through pass two (so its operands are offsets
+ * & relative constants) - whereas the caller hasn't (so its T vars are plain
+ * numbers & its constants are indices).
+ */
+void tco_remap_inline_operand(
+    zend_op_array *op_array,
+    zend_op_array *callee,
+    zend_op *source,
+    zend_uchar type,
+    znode_op *operand,
+    uint32_t *cv_map,
+    uint32_t t_base
+) {
+    switch (type) {
+        case IS_CONST:
+            operand->constant = tco_add_literal(op_array, RT_CONSTANT(source, *operand));
+
+            break;
+
+        case IS_CV:
+            operand->var = cv_map[EX_VAR_TO_NUM(operand->var)];
+
+            break;
+
+        case IS_TMP_VAR:
+        case IS_VAR:
+            operand->var = t_base + (EX_VAR_TO_NUM(operand->var) - callee->last_var);
+
+            break;
+    }
+}
+
+/*
+ * Writes the opcodes for a call to a given (small, non-recursive) callee to
+ * be inlined - see tco_find_inline_callee. These are:
+ *
+ * - An assignment to each of the callee's arguments, of whatever was passed
+ *   (or its default value).
+ * - The callee's body, up to & including its return - which now returns
+ *   from the caller instead.
+ *
+ * The callee's variables are added to the caller's (as "callee.variable")
+ * & its T vars are tacked on after the caller's.
+ *
+ * Returns the number of opcodes written.
+ */
+uint32_t tco_build_inline(
+    tco_context *context,
+    tco_call_meta *call_meta,
+    zend_op_array *callee,
+    uint32_t lineno
+) {
+    zend_op *source;
+    zend_op *op;
+
+    uint32_t i;
+
+    zend_op_array *op_array = context->op_array;
+
+    // Map each of the callee's CVs to one of the caller's.
+
+    uint32_t *cv_map = malloc(sizeof(uint32_t) * (callee->last_var + 1));
+
+    for (i = 0; i < callee->last_var; i++) {
+        cv_map[i] = tco_add_cv(
+            op_array,
+            zend_strpprintf(0, "%s.%s", ZSTR_VAL(callee->function_name), ZSTR_VAL(callee->vars[i]))
+        );
+    }
+
+    uint32_t t_base = op_array->T;
+
+    op_array->T += callee->T;
+
+    // There's 1 assignment per argument, plus the body (which ends at the first return).
+
+    uint32_t body_count = 0;
+
+    for (i = callee->num_args; i < callee->last; i++) {
+        if (callee->opcodes[i].opcode == ZEND_RETURN) {
+            ++body_count;
+
+            break;
+        }
+
+        if (
+            (callee->opcodes[i].opcode != ZEND_NOP)
+            && (callee->opcodes[i].opcode != ZEND_EXT_STMT)
+        ) {
+            ++body_count;
+        }
+    }
+
+    op = call_meta->inline_ops = malloc(sizeof(zend_op) * (callee->num_args + body_count));
+
+    for (i = 0; i < callee->num_args; i++) {
+        tco_init_op(op, ZEND_ASSIGN, lineno);
+
+        op->op1_type = IS_CV;
+        op->op1.var = cv_map[i];
+
+        if (call_meta->arg_types[i] == IS_UNUSED) {
+            source = &TCO_ARG_RECV_OPCODE(callee, i);
+
+            op->op2_type = IS_CONST;
+            op->op2.constant = tco_add_literal(op_array, RT_CONSTANT(source, source->op2));
+        } else {
+            op->op2_type = call_meta->arg_types[i];
+            op->op2.var = call_meta->arg_mapping[i];
+        }
+
+        ++op;
+    }
+
+    for (i = callee->num_args; i < callee->last; i++) {
+        source = &callee->opcodes[i];
+
+        if (
+            (source->opcode == ZEND_NOP)
+            || (source->opcode == ZEND_EXT_STMT)
+        ) {
+            continue;
+        }
+
+        *op = *source;
+
+        // (Any errors get reported against the call.)
+
+        op->lineno = lineno;
+        op->handler = NULL;
+
+        tco_remap_inline_operand(op_array, callee, source, op->op1_type, &op->op1, cv_map, t_base);
+        tco_remap_inline_operand(op_array, callee, source, op->op2_type, &op->op2, cv_map, t_base);
+        tco_remap_inline_operand(op_array, callee, source, op->result_type, &op->result, cv_map, t_base);
+
+        ++op;
+
+        if (source->opcode == ZEND_RETURN) {
+            break;
+        }
+    }
+
+    free(cv_map);
+
+    call_meta->inline_count = (uint32_t) (op - call_meta->inline_ops);
+
+    return call_meta->inline_count;
+}
+
+/*
+ * Makes sure there'll be room for a given number of opcodes for a call -
+ * reusing its spare opcodes first, then allocating the rest at the end.
+ */
+void tco_reserve_opcodes(tco_context *context, tco_call_meta *call_meta, uint32_t required_opcodes)
+{
+    uint32_t spare_opcodes = (call_meta->spare_last_index - call_meta->spare_start_index) + 1;
+
+    // (If they don't fit, an extra jump is needed to get to the rest.)
+
+    if (spare_opcodes < required_opcodes) {
+        context->total_extra_ops += (required_opcodes - spare_opcodes) + 1;
+    }
+}
+
+/*
+ * This function will analyse the opcodes for a given [...]
+ *
+ * The general idea here is:
+ *
+ * - Identify which T vars need to be preserved (i.e. those passed as arguments).
+ * - Track how much additional space will eventually be needed for the modified opcodes.
+ *
+ * (Not necessarily in that order.)
+ *
+ * For tail calls, last_index is the return following the call. For calls
+ * using the explicit stack, there's no return - so last_index is the call
+ * itself, and a frame will be pushed before the arguments are assigned.
+ *
+ * If a callee is given, the call isn't recursive at all - the callee's
+ * opcodes will be inlined in its place instead (see tco_build_inline).
+ */
+void tco_optimise_recursive_call(
+    tco_context *context,
+    uint32_t init_index,
+    uint32_t call_index,
+    uint32_t last_index,
+    bool push_frame,
+    uint32_t frame_layout,
+    zend_op_array *callee
+) {
+    zend_op *op;
+
+    uint32_t arg_index;
+
+    zend_op_array *op_array = context->op_array;
+
+    // The arguments being passed belong to whichever function is being called.
+
+    zend_op_array *target = callee ? callee : op_array;
+
+    // Flag the context as having been optimised, requiring compilation, etc.
+
+    context->do_compile = true;
+
+    // This will get/allocate a structure for storing meta data for the call.
+
+    tco_call_meta *call_meta = tco_get_new_call_meta(context, target->num_args);
+
+    call_meta->init_index = init_index;
+
+    // (Inlined calls keep the line number of the call, for any errors.)
+
+    uint32_t lineno = op_array->opcodes[call_index].lineno;
+
+    // If a frame needs pushing, we need to know what goes in it (including
+    // where to resume from) and where the call's result should end up when
+    // the frame is popped.
+
+    if (push_frame) {
+        op = &op_array->opcodes[call_index];
+
+        call_meta->push_frame = true;
+        call_meta->frame_layout = frame_layout;
+        call_meta->result_type = op->result_type;
+        call_meta->result_var = op->result.var;
+    }
+
+    // At some point we'll need to know how many arguments were passed.
+    // (This will be updated as various send opcodes are encountered.)
+
+    uint32_t args_passed_count = 0;
+
+    // T variable (re)mapping.
+
+    uint32_t *t_remaps = tco_get_t_remaps(context, !push_frame);
+
+    // This is used to track the next available (newly-created) T var.
+    // (op_array->T itself will be updated elsewhere.)
+
+    uint32_t next_free_t_var = op_array->T;
+
+    /*
      * As we go through the opcodes, the ones we want to keep will be shuffled up
      * the op array. This variable will be used to track which index should be
      * written to next.
@@ -508,13 +1343,15 @@ void tco_optimise_recursive_call(
 
     uint32_t destination_index = init_index;
 
-    // This loop will skip the init at the first index - and the call and return at the end.
+    // Calls nested among the arguments keep their own sends (see below).
 
-    uint32_t index_limit = return_index - 1;
+    uint32_t nested_calls = 0;
+
+    // This loop will skip the init at the first index - and the call (and any return) at the end.
 
     for (
         uint32_t i = init_index + 1;
-        i < index_limit;
+        i < call_index;
         i++
     ) {
         op = &op_array->opcodes[i];
@@ -540,16 +1377,57 @@ void tco_optimise_recursive_call(
 
         switch (op->opcode) {
             case ZEND_CHECK_UNDEF_ARGS:
-                // This opcode isn't needed.
+                // This opcode isn't needed (unless it's a nested call's).
+
+                if (nested_calls > 0) {
+                    op_array->opcodes[destination_index++] = *op;
+
+                    break;
+                }
 
                 tco_nop_out(op);
 
                 break;
 
+            case ZEND_INIT_NS_FCALL_BY_NAME:
+            case ZEND_INIT_METHOD_CALL:
+            case ZEND_INIT_STATIC_METHOD_CALL:
+            case ZEND_INIT_FCALL:
+            case ZEND_INIT_FCALL_BY_NAME:
+            case ZEND_INIT_DYNAMIC_CALL:
+            case ZEND_INIT_USER_CALL:
+            case ZEND_NEW:
+                ++nested_calls;
+
+                op_array->opcodes[destination_index++] = *op;
+
+                break;
+
+#ifdef ZEND_CALLABLE_CONVERT
+            case ZEND_CALLABLE_CONVERT:
+#endif
+            case ZEND_DO_ICALL:
+            case ZEND_DO_UCALL:
+            case ZEND_DO_FCALL:
+            case ZEND_DO_FCALL_BY_NAME:
+                --nested_calls;
+
+                op_array->opcodes[destination_index++] = *op;
+
+                break;
+
             case ZEND_SEND_VAR_EX:
             case ZEND_SEND_VAL_EX:
             case ZEND_SEND_VAR:
             case ZEND_SEND_VAL:
+                // (Sends for a nested call are left where they are.)
+
+                if (nested_calls > 0) {
+                    op_array->opcodes[destination_index++] = *op;
+
+                    break;
+                }
+
                 ++args_passed_count;
 
                 // If I'm not wrong, operand 2 being a constant means it's a named argument.
@@ -560,7 +1438,7 @@ void tco_optimise_recursive_call(
 
                     arg_index = tco_find_named_arg(
                         Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant)),
-                        context
+                        target
                     );
                 } else {
                     // (The indices in the operand are 1-based - so we'll have to subtract 1.)
@@ -571,6 +1449,7 @@ void tco_optimise_recursive_call(
                 // Map this argument to its respective (T) variable.
 
                 call_meta->arg_mapping[arg_index] = op->op1.var;
+                call_meta->arg_types[arg_index] = op->op1_type;
 
                 // Any T variable used here needs to be protected.
                 // (It needs to retain its value for the assignment later.)
@@ -597,7 +1476,7 @@ void tco_optimise_recursive_call(
     }
 
     /*
-     * By now, between destination_index and return_index there may be some
+     * By now, between destination_index and last_index there may be some
      * spare/unused opcodes (e.g. the send/call/return opcodes we ignored, the
      * ZEND_CHECK_UNDEF_ARGS we nopped out, etc.).
      *
@@ -607,141 +1486,2920 @@ void tco_optimise_recursive_call(
      *
      * So here we'll essentially calculate how much new memory may be needed.
      *
-     * We need 1 opcode per argument (for assignments) and 1 for the jump back
-     * to the beginning. If we don't have enough spare opcodes to reuse, we'll
+     * We need 1 opcode per argument move (see tco_plan_arg_moves) and 1 for the
+     * jump back to the beginning. If we don't have enough spare opcodes to reuse, we'll
      * need an additional jump (to where ever the remaining assignments are).
+     *
+     * (Pushing a frame takes 1 more - but at least 2 opcodes are always spare
+     * here, the init & the call, so the push itself will always fit.)
      */
 
-    uint32_t required_opcodes = op_array->num_args + 1;
-    uint32_t spare_opcodes = (return_index - destination_index) + 1;
+    // We'll set the indices to where the spare opcodes begin & end, then reserve what's needed.
 
-    if (spare_opcodes < required_opcodes) {
-        context->total_extra_ops += (required_opcodes - spare_opcodes) + 1;
-    }
+    call_meta->spare_start_index = destination_index;
+    call_meta->spare_last_index = last_index;
 
-    // Either way, we'll set the indices to where the spare opcodes begin & end.
+    if (callee) {
+        // Inlined code ends with the callee's return, rather than a jump.
 
-    call_meta->spare_start_index = destination_index;
-    call_meta->spare_last_index = return_index;
+        tco_reserve_opcodes(context, call_meta, tco_build_inline(context, call_meta, callee, lineno));
+    } else if (!context->reentry_stages) {
+        tco_reserve_opcodes(context, call_meta, tco_plan_arg_moves(context, call_meta) + (push_frame ? 2 : 1));
+    }
+
+    // (With a shared re-entry block, this waits until every call's been seen - see tco_plan_reentry.)
 }
 
 /*
- * Analyses the op array, looking for & optimising any recursive function calls.
+ * Renames a T var within a given range of opcodes.
  */
-void tco_analyse(tco_context *context)
+void tco_rename_t_var(zend_op_array *op_array, uint32_t start, uint32_t end, uint32_t from, uint32_t to)
 {
-    uint32_t i;
-
     zend_op *op;
-    uint32_t return_index;
-
-    zend_op_array *op_array = context->op_array;
 
-    uint32_t search_state = TCO_STATE_SEEKING_RETURN;
+    for (uint32_t i = start; i < end; i++) {
+        op = &op_array->opcodes[i];
 
-    // I think all op arrays are guaranteed to have at least one opcode, but just in case...
+        if ((op->op1_type & IS_TMP_VAR) && (op->op1.var == from)) {
+            op->op1.var = to;
+        }
 
-    if (op_array->last < 1) {
-        // If there are no opcodes, there's nothing to do.
+        if ((op->op2_type & IS_TMP_VAR) && (op->op2.var == from)) {
+            op->op2.var = to;
+        }
 
-        return;
+        if ((op->result_type & IS_TMP_VAR) && (op->result.var == from)) {
+            op->result.var = to;
+        }
     }
+}
 
-    /*
-     * First, we need to iterate "forwards" over the opcodes, looking for where
-     * the various recv opcodes end - because we need this starting address
-     * so that we know where to jump (back) to for each reiteration.
-     *
-     * (This could/should maybe be deferred & done elsewhere.)
-     */
+/*
+ * Plans the shared re-entry block (see TCO_SHARED_REENTRY_SITES) once every
+ * call has been seen.
+ *
+ * Each argument changed by any of the calls gets its own T var, which the
+ * block assigns to the argument. Calls then only need to get their values
+ * into those T vars:
+ *
+ * - A value computed into a T var (e.g. f($n - 1)) is simply computed into
+ *   the block's T var instead - so costs nothing at all.
+ * - Anything else is copied (QM_ASSIGN) - including arguments passed as
+ *   themselves, if some other call changes them.
+ *
+ * As everything is copied before anything's assigned, arguments swapping
+ * places (e.g. f($b, $a)) need no special treatment.
+ *
+ * The block itself goes straight after the first call with room for it.
+ * Pass two works out which T vars are live by scanning backwards from where
+ * they're read - so this way, the block's T vars only ever look live
+ * between that call & the block. (If no call has room, the calls are left
+ * to do their own assignments after all.)
+ */
+void tco_plan_reentry(tco_context *context)
+{
+    tco_call_meta *call_meta;
 
-    bool found_start_address = false;
+    uint32_t arg_index;
+    uint32_t required_opcodes;
 
-    for (
-        i = 0;
-        (i < op_array->last) && !found_start_address;
-        i++
-    ) {
-        switch (op_array->opcodes[i].opcode) {
-            case ZEND_RECV_INIT:
-            case ZEND_RECV:
-                break;
+    zend_op_array *op_array = context->op_array;
 
-            default:
-                /*
-                 * If we're here, context->start_address should be pointing to
-                 * the address of the first opcode of the function, sans any
-                 * initialisation, etc.
-                 */
+    for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+        context->reentry_stages[arg_index] = TCO_NO_STAGE;
+        context->reentry_holds[arg_index] = TCO_NO_STAGE;
+    }
 
-                context->start_address = i;
+    context->reentry_address = context->start_address;
 
-                found_start_address = true;
+    // Work out which arguments are changed by at least one call.
+
+    for (call_meta = context->call_meta_tail; call_meta; call_meta = call_meta->previous) {
+        if (call_meta->inline_ops) {
+            continue;
+        }
+
+        for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+            if (
+                (context->reentry_stages[arg_index] == TCO_NO_STAGE)
+                && (
+                    (call_meta->arg_types[arg_index] != IS_CV)
+                    || (tco_find_arg_cv(op_array, call_meta->arg_mapping[arg_index]) != arg_index)
+                )
+            ) {
+                context->reentry_stages[arg_index] = op_array->T++;
+                context->reentry_count++;
+            }
         }
     }
 
-    // Now we need to go over the rest of the opcodes, but backwards.
+    // Now work out how many opcodes each call needs - & which will host the block.
 
-    for (i = op_array->last; i > 0; i--) {
-        op = &op_array->opcodes[i];
+    for (call_meta = context->call_meta_tail; call_meta; call_meta = call_meta->previous) {
+        if (call_meta->inline_ops) {
+            continue;
+        }
 
-        switch (op->opcode) {
-            case ZEND_RETURN:
-                // Found a return; now we want to see if it was preceded by a call opcode.
+        required_opcodes = (call_meta->push_frame || context->shadow_cv) ? 2 : 1;
 
-                search_state = TCO_STATE_SEEKING_CALL;
-                return_index = i;
+        for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+            // (This counts as if the call weren't the host - which needs fewer, see below.)
 
-                break;
+            if (context->reentry_stages[arg_index] == TCO_NO_STAGE) {
+                call_meta->arg_moves[arg_index] = TCO_MOVE_NONE;
+            } else {
+                call_meta->arg_moves[arg_index] = TCO_MOVE_STAGED;
+                required_opcodes++;
 
-            case ZEND_DO_UCALL:
-            case ZEND_DO_FCALL:
-            case ZEND_DO_FCALL_BY_NAME:
-                if (search_state == TCO_STATE_SEEKING_CALL) {
-                    // Found a call immediately preceding a return; now we want
-                    // to find its respective init call.
+                // (CVs are held in a T var first - see tco_build_shared_moves.)
+
+                if (call_meta->arg_types[arg_index] == IS_CV) {
+                    if (context->reentry_holds[arg_index] == TCO_NO_STAGE) {
+                        context->reentry_holds[arg_index] = op_array->T++;
+                    }
 
-                    search_state = TCO_STATE_SEEKING_INIT;
+                    required_opcodes++;
                 }
+            }
 
-                break;
+            // (Plus an unset for each local CV passed.)
 
-         // case ZEND_INIT_NS_FCALL_BY_NAME:
-            case ZEND_INIT_METHOD_CALL:
+            if (
+                (call_meta->arg_types[arg_index] == IS_CV)
+                && (tco_find_arg_cv(op_array, call_meta->arg_mapping[arg_index]) == op_array->num_args)
+                && !tco_is_cv_passed_earlier(call_meta, arg_index)
+            ) {
+                required_opcodes++;
+            }
+        }
+
+        // (move_count doesn't include the jump at the end.)
+
+        call_meta->move_count = required_opcodes - 1;
+
+        if (
+            ((required_opcodes + context->reentry_count) <= (call_meta->spare_last_index - call_meta->spare_start_index) + 1)
+            && (
+                !context->reentry_host
+                || (call_meta->spare_start_index < context->reentry_host->spare_start_index)
+            )
+        ) {
+            context->reentry_host = call_meta;
+        }
+    }
+
+    if (!context->reentry_host) {
+        free(context->reentry_stages);
+
+        context->reentry_stages = NULL;
+        context->reentry_holds = NULL;
+        context->reentry_count = 0;
+
+        for (call_meta = context->call_meta_tail; call_meta; call_meta = call_meta->previous) {
+            if (!call_meta->inline_ops) {
+                tco_reserve_opcodes(context, call_meta, tco_plan_arg_moves(context, call_meta) + (call_meta->push_frame ? 2 : 1));
+            }
+        }
+
+        return;
+    }
+
+    context->reentry_host->move_count += context->reentry_count;
+
+    for (call_meta = context->call_meta_tail; call_meta; call_meta = call_meta->previous) {
+        if (call_meta->inline_ops) {
+            continue;
+        }
+
+        /*
+         * At the host, values computed into T vars get computed straight into
+         * the block's instead - & CVs are copied straight there, too. (Not
+         * anywhere else, though - see tco_build_shared_moves.)
+         */
+
+        if (call_meta != context->reentry_host) {
+            tco_reserve_opcodes(context, call_meta, call_meta->move_count + 1);
+
+            continue;
+        }
+
+        for (arg_index = 0; arg_index < op_array->num_args; arg_index++) {
+            if (call_meta->arg_moves[arg_index] != TCO_MOVE_STAGED) {
+                continue;
+            }
+
+            if (call_meta->arg_types[arg_index] == IS_TMP_VAR) {
+                tco_rename_t_var(
+                    op_array,
+                    call_meta->init_index,
+                    call_meta->spare_start_index,
+                    call_meta->arg_mapping[arg_index],
+                    context->reentry_stages[arg_index]
+                );
+
+                call_meta->arg_mapping[arg_index] = context->reentry_stages[arg_index];
+                call_meta->arg_moves[arg_index] = TCO_MOVE_NONE;
+                call_meta->move_count--;
+            } else if (call_meta->arg_types[arg_index] == IS_CV) {
+                call_meta->move_count--;
+            }
+        }
+
+        tco_reserve_opcodes(context, call_meta, call_meta->move_count + 1);
+    }
+}
+
+/*
+ * Determines whether a given op array has opted in to (and is able to use)
+ * the explicit stack for its non-tail recursive calls.
+ */
+bool tco_wants_explicit_stack(zend_op_array *op_array)
+{
+    // It's opt-in only, by way of an attribute on the function/method.
+
+    if (
+        (TCO_EXPLICIT_STACK == 0)
+        || !op_array->attributes
+        || !zend_get_attribute_str(
+            op_array->attributes,
+            TCO_EXPLICIT_STACK_ATTRIBUTE,
+            sizeof(TCO_EXPLICIT_STACK_ATTRIBUTE) - 1
+        )
+    ) {
+        return false;
+    }
+
+    /*
+     * Generators, reference returns & variadics each have their own way of
+     * handling frames/arguments that we'd trample on.
+     *
+     * A try/catch is a no-go too: an exception thrown "inside" a popped frame
+     * would be caught by the outermost invocation, rather than the one it
+     * was actually thrown from.
+     */
+
+    if (op_array->fn_flags & (ZEND_ACC_GENERATOR | ZEND_ACC_RETURN_REFERENCE | ZEND_ACC_VARIADIC)) {
+        return false;
+    }
+
+    if (op_array->last_try_catch > 0) {
+        return false;
+    }
+
+    /*
+     * Resume points are opcode offsets, which OPcache's optimiser knows
+     * nothing about - so once it's renumbered the opcodes, a popped frame
+     * would resume from the wrong place. (Same check as tco_tier_op_array.)
+     */
+
+    if (CG(compiler_options) & ZEND_COMPILE_DELAYED_BINDING) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Adds the hidden CV used to track the explicit stack depth & returns it.
+ *
+ * CVs are always initialised to UNDEF when a function is entered, which is
+ * exactly what we need to tell a fresh invocation from one with frames.
+ */
+uint32_t tco_add_stack_cv(zend_op_array *op_array)
+{
+    return tco_add_cv(
+        op_array,
+        zend_string_init(TCO_STACK_CV_NAME, sizeof(TCO_STACK_CV_NAME) - 1, 0)
+    );
+}
+
+/*
+ * Returns the address a given opcode (before pass two) can jump to - or
+ * (uint32_t) -1 if it doesn't jump anywhere. (Jump tables only ever jump
+ * forwards, so they're left out.)
+ */
+uint32_t tco_get_jump_target(zend_op *op)
+{
+    switch (op->opcode) {
+        case ZEND_JMP:
+            return op->op1.opline_num;
+
+        case ZEND_JMPZ:
+        case ZEND_JMPNZ:
+        case ZEND_JMPZ_EX:
+        case ZEND_JMPNZ_EX:
+        case ZEND_JMP_SET:
+        case ZEND_COALESCE:
+        case ZEND_JMP_NULL:
+        case ZEND_FE_RESET_R:
+        case ZEND_FE_RESET_RW:
+            return op->op2.opline_num;
+
+        case ZEND_FE_FETCH_R:
+        case ZEND_FE_FETCH_RW:
+            return op->extended_value;
+
+#ifdef ZEND_JMPZNZ
+        case ZEND_JMPZNZ:
+            return MIN(op->op2.opline_num, op->extended_value);
+#endif
+    }
+
+    return (uint32_t) -1;
+}
+
+/*
+ * Determines whether a given op array gets at its CVs in ways that can't be
+ * seen from its operands - e.g. compact(), extract(), $$name or include - in
+ * which case any CV could be used at any time.
+ */
+bool tco_has_dynamic_cvs(zend_op_array *op_array)
+{
+    zend_op *op;
+    zend_string *name;
+
+    for (uint32_t i = 0; i < op_array->last; i++) {
+        op = &op_array->opcodes[i];
+
+        switch (op->opcode) {
+            case ZEND_FETCH_R:
+            case ZEND_FETCH_W:
+            case ZEND_FETCH_RW:
+            case ZEND_FETCH_IS:
+            case ZEND_FETCH_FUNC_ARG:
+            case ZEND_FETCH_UNSET:
+            case ZEND_UNSET_VAR:
+            case ZEND_ISSET_ISEMPTY_VAR:
+            case ZEND_INCLUDE_OR_EVAL:
+            case ZEND_FUNC_GET_ARGS:
+                return true;
+
+            // (The lowercase name is the literal after the name itself - or 2 after, if namespaced.)
+
+            case ZEND_INIT_FCALL:
+                name = Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant));
+                break;
+
+            case ZEND_INIT_FCALL_BY_NAME:
+                name = Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant + 1));
+                break;
+
+            case ZEND_INIT_NS_FCALL_BY_NAME:
+                name = Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant + 2));
+                break;
+
+            default:
+                continue;
+        }
+
+        if (
+            zend_string_equals_literal(name, "compact")
+            || zend_string_equals_literal(name, "extract")
+            || zend_string_equals_literal(name, "get_defined_vars")
+            || zend_string_equals_literal(name, "func_get_args")
+            || zend_string_equals_literal(name, "func_get_arg")
+        ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Determines whether a given opcode builds on the T var in its result (e.g.
+ * adding an element to an array), rather than defining it afresh.
+ */
+bool tco_is_accumulating_op(zend_op *op)
+{
+    switch (op->opcode) {
+        case ZEND_ADD_ARRAY_ELEMENT:
+        case ZEND_ADD_ARRAY_UNPACK:
+        case ZEND_ROPE_ADD:
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Determines whether a given opcode reads a given T var.
+ */
+bool tco_op_uses_t(zend_op *op, uint32_t var)
+{
+    return ((op->op1_type & (IS_TMP_VAR | IS_VAR)) && (op->op1.var == var))
+        || ((op->op2_type & (IS_TMP_VAR | IS_VAR)) && (op->op2.var == var))
+        || ((op->result_type & (IS_TMP_VAR | IS_VAR)) && (op->result.var == var) && tco_is_accumulating_op(op));
+}
+
+/*
+ * Determines whether a given opcode writes a given T var.
+ */
+bool tco_op_defines_t(zend_op *op, uint32_t var)
+{
+    return (op->result_type & (IS_TMP_VAR | IS_VAR))
+        && (op->result.var == var);
+}
+
+/*
+ * Looks for where a given T var was defined, if it holds a value across a
+ * call - i.e. it's defined before the call's init & used after the call.
+ *
+ * T vars are only used the once (or built up in place, like arrays) - so a
+ * T var defined & used on the same side of the call is long gone by then.
+ *
+ * Returns the opcode that defined it, or NULL if it's not live.
+ */
+zend_op *tco_find_live_t_def(zend_op_array *op_array, uint32_t init_index, uint32_t call_index, uint32_t var)
+{
+    zend_op *op;
+
+    uint32_t i;
+
+    // The first time it's touched after the call has to be a use.
+
+    for (i = call_index + 1; i < op_array->last; i++) {
+        op = &op_array->opcodes[i];
+
+        if (tco_op_uses_t(op, var)) {
+            break;
+        }
+
+        if (tco_op_defines_t(op, var)) {
+            return NULL;
+        }
+    }
+
+    if (i == op_array->last) {
+        return NULL;
+    }
+
+    // (Anything defined by the call itself - or its arguments - isn't held across it.)
+
+    for (i = init_index; i <= call_index; i++) {
+        if (
+            tco_op_defines_t(&op_array->opcodes[i], var)
+            && !tco_is_accumulating_op(&op_array->opcodes[i])
+        ) {
+            return NULL;
+        }
+    }
+
+    for (i = init_index; i-- > 0;) {
+        op = &op_array->opcodes[i];
+
+        if (
+            tco_op_defines_t(op, var)
+            && !tco_is_accumulating_op(op)
+        ) {
+            return op;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Works out what a call using the explicit stack needs to keep in its frame
+ * - and adds the layout (see TCO_LAYOUT_HEADER) to the literals.
+ *
+ * CVs are kept if they're used anywhere that can be reached once the call
+ * returns (including by looping back round). Any other CVs are dead, so
+ * they're released instead. T vars are kept if they hold a value across
+ * the call.
+ *
+ * Returns the layout's literal, or TCO_NO_LAYOUT if the call can't use the
+ * explicit stack after all (e.g. it's in the middle of building a string).
+ */
+uint32_t tco_plan_frame_layout(zend_op_array *op_array, uint32_t init_index, uint32_t call_index, bool dynamic_cvs)
+{
+    zend_op *op;
+    zend_op *def;
+    zval layout;
+
+    uint32_t i;
+    uint32_t target;
+    uint32_t kind;
+
+    uint32_t start = call_index + 1;
+
+    bool widened = true;
+
+    // Loops can take execution back to before the call - so the range that's
+    // reachable afterwards is widened to take them in.
+
+    while (widened) {
+        widened = false;
+
+        for (i = start; i < op_array->last; i++) {
+            target = tco_get_jump_target(&op_array->opcodes[i]);
+
+            if (target < start) {
+                start = target;
+                widened = true;
+            }
+        }
+    }
+
+    bool *cv_used = calloc(op_array->last_var, sizeof(bool));
+
+    for (i = start; i < op_array->last; i++) {
+        op = &op_array->opcodes[i];
+
+        if (op->op1_type == IS_CV) {
+            cv_used[EX_VAR_TO_NUM(op->op1.var)] = true;
+        }
+
+        if (op->op2_type == IS_CV) {
+            cv_used[EX_VAR_TO_NUM(op->op2.var)] = true;
+        }
+
+        if (op->result_type == IS_CV) {
+            cv_used[EX_VAR_TO_NUM(op->result.var)] = true;
+        }
+    }
+
+    uint32_t *entries = malloc(sizeof(uint32_t) * (TCO_LAYOUT_HEADER + op_array->last_var + op_array->T));
+    uint32_t slot_count = 0;
+    uint32_t dead_count = 0;
+
+    // CVs first. (Our own hidden CVs are left exactly as they are.)
+
+    for (i = 0; i < op_array->last_var; i++) {
+        if (
+            zend_string_equals_literal(op_array->vars[i], TCO_STACK_CV_NAME)
+            || zend_string_equals_literal(op_array->vars[i], TCO_SHADOW_CV_NAME)
+        ) {
+            continue;
+        }
+
+        if (cv_used[i] || dynamic_cvs) {
+            entries[TCO_LAYOUT_HEADER + slot_count++] = TCO_SLOT_ENTRY(i, TCO_SLOT_CV);
+        }
+    }
+
+    // Then the T vars - which need letting go of in different ways, depending on what defined them.
+
+    for (i = 0; i < op_array->T; i++) {
+        def = tco_find_live_t_def(op_array, init_index, call_index, i);
+
+        if (!def) {
+            continue;
+        }
+
+        switch (def->opcode) {
+            case ZEND_ROPE_INIT:
+            case ZEND_NEW:
+                // (Ropes span several T vars - & a new object comes with a constructor call in progress.)
+
+                free(cv_used);
+                free(entries);
+
+                return TCO_NO_LAYOUT;
+
+            case ZEND_FE_RESET_R:
+            case ZEND_FE_RESET_RW:
+                kind = TCO_SLOT_LOOP;
+                break;
+
+            case ZEND_FETCH_CLASS:
+            case ZEND_DECLARE_ANON_CLASS:
+            case ZEND_BEGIN_SILENCE:
+                kind = TCO_SLOT_RAW;
+                break;
+
+            default:
+                kind = TCO_SLOT_TMP;
+        }
+
+        entries[TCO_LAYOUT_HEADER + slot_count++] = TCO_SLOT_ENTRY(i, kind);
+    }
+
+    // Finally, the dead CVs.
+
+    for (i = 0; i < op_array->last_var; i++) {
+        if (
+            zend_string_equals_literal(op_array->vars[i], TCO_STACK_CV_NAME)
+            || zend_string_equals_literal(op_array->vars[i], TCO_SHADOW_CV_NAME)
+            || cv_used[i]
+            || dynamic_cvs
+        ) {
+            continue;
+        }
+
+        entries[TCO_LAYOUT_HEADER + slot_count + dead_count++] = TCO_SLOT_ENTRY(i, TCO_SLOT_DEAD_CV);
+    }
+
+    entries[0] = call_index + 1;
+    entries[1] = slot_count;
+    entries[2] = dead_count;
+
+    ZVAL_STRINGL(&layout, (char *) entries, sizeof(uint32_t) * (TCO_LAYOUT_HEADER + slot_count + dead_count));
+
+    uint32_t literal = tco_add_literal(op_array, &layout);
+
+    zval_ptr_dtor(&layout);
+
+    free(cv_used);
+    free(entries);
+
+    return literal;
+}
+
+/*
+ * Determines whether every return in the op array returns null.
+ */
+bool tco_returns_only_null(zend_op_array *op_array)
+{
+    zend_op *op;
+
+    for (uint32_t i = 0; i < op_array->last; i++) {
+        op = &op_array->opcodes[i];
+
+        if (
+            (op->opcode == ZEND_RETURN)
+            && (
+                (op->op1_type != IS_CONST)
+                || (Z_TYPE_P(CT_CONSTANT_EX(op_array, op->op1.constant)) != IS_NULL)
+            )
+        ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Determines whether a generator ever yields without a key - i.e. has keys
+ * generated for it.
+ */
+bool tco_has_auto_keys(zend_op_array *op_array)
+{
+    zend_op *op;
+
+    for (uint32_t i = 0; i < op_array->last; i++) {
+        op = &op_array->opcodes[i];
+
+        if (
+            (op->opcode == ZEND_YIELD)
+            && (op->op2_type == IS_UNUSED)
+        ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Looks for a call being delegated to (via yield from) directly before the
+ * given return in a generator - i.e. something like:
+ *
+ *     V3 = DO_UCALL
+ *     T4 = YIELD_FROM V3
+ *     FREE T4
+ *     RETURN null
+ *
+ * (Or RETURN T4, for "return yield from ...".)
+ *
+ * Returns the index of the call, or 0 if there isn't one.
+ */
+uint32_t tco_find_delegated_call(zend_op_array *op_array, uint32_t return_index)
+{
+    zend_op *return_op = &op_array->opcodes[return_index];
+    zend_op *op;
+
+    uint32_t i = return_index - 1;
+
+    // The generator's return value needs to be whatever the delegate returned.
+    // If the result of the yield from is thrown away, that's only true when
+    // every return (i.e. the delegate's, eventually) returns null anyway.
+
+    bool result_discarded = false;
+
+    if (i < 2) {
+        return 0;
+    }
+
+    op = &op_array->opcodes[i];
+
+    if (
+        (op->opcode == ZEND_FREE)
+        && (op->op1_type == IS_TMP_VAR)
+    ) {
+        result_discarded = true;
+
+        --i;
+    }
+
+    zend_op *yield_from_op = &op_array->opcodes[i];
+
+    if (yield_from_op->opcode != ZEND_YIELD_FROM) {
+        return 0;
+    }
+
+    if (result_discarded) {
+        if (
+            (yield_from_op->result_type != IS_TMP_VAR)
+            || (yield_from_op->result.var != op->op1.var)
+        ) {
+            return 0;
+        }
+    } else if (yield_from_op->result_type == IS_UNUSED) {
+        result_discarded = true;
+    } else if (
+        (return_op->op1_type != yield_from_op->result_type)
+        || (return_op->op1.var != yield_from_op->result.var)
+    ) {
+        return 0;
+    }
+
+    if (result_discarded && !tco_returns_only_null(op_array)) {
+        return 0;
+    }
+
+    // Finally, the thing being delegated to has to be the result of the call just before.
+
+    op = &op_array->opcodes[--i];
+
+    switch (op->opcode) {
+        case ZEND_DO_UCALL:
+        case ZEND_DO_FCALL:
+        case ZEND_DO_FCALL_BY_NAME:
+            if (
+                (yield_from_op->op1_type == op->result_type)
+                && (yield_from_op->op1.var == op->result.var)
+            ) {
+                return i;
+            }
+    }
+
+    return 0;
+}
+
+/*
+ * Looks for the return a given generator call is delegated to (via yield
+ * from) right before - see tco_find_delegated_call.
+ *
+ * Returns the index of the return, or 0 if there isn't one.
+ */
+uint32_t tco_find_delegated_return(zend_op_array *op_array, uint32_t call_index)
+{
+    uint32_t i = call_index + 1;
+
+    if (
+        (i >= op_array->last)
+        || (op_array->opcodes[i].opcode != ZEND_YIELD_FROM)
+    ) {
+        return 0;
+    }
+
+    if (
+        (++i < op_array->last)
+        && (op_array->opcodes[i].opcode == ZEND_FREE)
+    ) {
+        ++i;
+    }
+
+    if (
+        (i < op_array->last)
+        && (op_array->opcodes[i].opcode == ZEND_RETURN)
+        && (tco_find_delegated_call(op_array, i) == call_index)
+    ) {
+        return i;
+    }
+
+    return 0;
+}
+
+/*
+ * Determines whether a given call is in tail position - i.e. its result
+ * ends up being returned, untouched.
+ *
+ * The result is followed forwards through copies & jumps, so as well as the
+ * obvious "return f()", this will catch things like:
+ *
+ *     return $c ? f($a) : f($b);
+ *     return match ($x) { 1 => f($a), default => f($b) };
+ *
+ * ...where each call's result is copied (QM_ASSIGN) into a shared T var,
+ * before jumping to a shared return.
+ *
+ * Returns the last index of the opcodes the call's rewrite can reuse - or 0
+ * if the call isn't in tail position.
+ *
+ * Opcodes straight after the call which read the call's own result can only
+ * be reached from the call, so they're safe to reuse. Anything after a jump
+ * (or reading a shared copy of the result) may be reached from elsewhere.
+ */
+uint32_t tco_find_tail_return(zend_op_array *op_array, uint32_t call_index)
+{
+    zend_op *op = &op_array->opcodes[call_index];
+
+    zend_uchar var_type = op->result_type;
+    uint32_t var = op->result.var;
+
+    uint32_t i = call_index + 1;
+    uint32_t last_index = call_index;
+
+    bool own_result = true;
+
+    // (If the result isn't used, whatever's returned, it isn't the call's result.)
+
+    if (var_type == IS_UNUSED) {
+        return 0;
+    }
+
+    // Jumps could (in theory) go round in circles - so there's a limit on how far we'll look.
+
+    for (uint32_t steps = 0; (i < op_array->last) && (steps < op_array->last); steps++) {
+        op = &op_array->opcodes[i];
+
+        switch (op->opcode) {
+            case ZEND_RETURN:
+                if (
+                    (op->op1_type != var_type)
+                    || (op->op1.var != var)
+                ) {
+                    return 0;
+                }
+
+                if (own_result) {
+                    last_index = i;
+                }
+
+                return last_index;
+
+            case ZEND_QM_ASSIGN:
+            case ZEND_VERIFY_RETURN_TYPE:
+                // A copy of the result (or a check of its type, which the
+                // recursive call will be doing for itself anyway).
+
+                if (
+                    (op->op1_type != var_type)
+                    || (op->op1.var != var)
+                ) {
+                    return 0;
+                }
+
+                if (own_result) {
+                    last_index = i;
+                }
+
+                if (op->result_type != IS_UNUSED) {
+                    var_type = op->result_type;
+                    var = op->result.var;
+
+                    own_result = false;
+                }
+
+                ++i;
+
+                break;
+
+            case ZEND_NOP:
+                own_result = false;
+
+                ++i;
+
+                break;
+
+            case ZEND_JMP:
+                own_result = false;
+
+                i = op->op1.opline_num;
+
+                break;
+
+            default:
+                // Anything else means the result is being used for something.
+
+                return 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Determines whether a given opcode (from a callee) is simple enough to be
+ * inlined - i.e. it only touches the callee's own variables, never jumps &
+ * never calls anything.
+ */
+bool tco_is_inlinable_op(zend_op *op)
+{
+    // (Comparisons feeding straight into a jump are no good without the jump.)
+
+    if (op->result_type & (IS_SMART_BRANCH_JMPZ | IS_SMART_BRANCH_JMPNZ)) {
+        return false;
+    }
+
+    switch (op->opcode) {
+        case ZEND_ASSIGN:
+        case ZEND_ASSIGN_OP:
+        case ZEND_PRE_INC:
+        case ZEND_PRE_DEC:
+        case ZEND_POST_INC:
+        case ZEND_POST_DEC:
+            // Only plain variables - anything else could be writing anywhere.
+
+            return (op->op1_type == IS_CV);
+
+        case ZEND_INIT_ARRAY:
+        case ZEND_ADD_ARRAY_ELEMENT:
+            return !(op->extended_value & ZEND_ARRAY_ELEMENT_REF);
+
+        case ZEND_ADD:
+        case ZEND_SUB:
+        case ZEND_MUL:
+        case ZEND_DIV:
+        case ZEND_MOD:
+        case ZEND_SL:
+        case ZEND_SR:
+        case ZEND_POW:
+        case ZEND_CONCAT:
+        case ZEND_FAST_CONCAT:
+        case ZEND_BW_OR:
+        case ZEND_BW_AND:
+        case ZEND_BW_XOR:
+        case ZEND_BW_NOT:
+        case ZEND_BOOL:
+        case ZEND_BOOL_NOT:
+        case ZEND_BOOL_XOR:
+        case ZEND_IS_IDENTICAL:
+        case ZEND_IS_NOT_IDENTICAL:
+        case ZEND_IS_EQUAL:
+        case ZEND_IS_NOT_EQUAL:
+        case ZEND_IS_SMALLER:
+        case ZEND_IS_SMALLER_OR_EQUAL:
+        case ZEND_SPACESHIP:
+        case ZEND_QM_ASSIGN:
+        case ZEND_CAST:
+        case ZEND_STRLEN:
+        case ZEND_COUNT:
+        case ZEND_TYPE_CHECK:
+        case ZEND_FREE:
+        case ZEND_FETCH_DIM_R:
+        case ZEND_ISSET_ISEMPTY_CV:
+        case ZEND_ARRAY_KEY_EXISTS:
+        case ZEND_ROPE_INIT:
+        case ZEND_ROPE_ADD:
+        case ZEND_ROPE_END:
+        case ZEND_RETURN:
+        case ZEND_NOP:
+        case ZEND_EXT_STMT:
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Checks whether a given (already compiled) function is simple enough to be
+ * inlined - see tco_find_inline_callee.
+ */
+bool tco_check_inlinable_callee(zend_op_array *callee)
+{
+    zend_op *callee_op;
+
+    if (
+        callee->fn_flags & (
+            ZEND_ACC_GENERATOR
+            | ZEND_ACC_RETURN_REFERENCE
+            | ZEND_ACC_VARIADIC
+            | ZEND_ACC_CLOSURE
+            | ZEND_ACC_HAS_TYPE_HINTS
+            | ZEND_ACC_HAS_RETURN_TYPE
+            | ZEND_ACC_DEPRECATED
+            | ZEND_ACC_ABSTRACT
+        )
+    ) {
+        return false;
+    }
+
+    if (
+        callee->static_variables
+        || (callee->last_try_catch > 0)
+    ) {
+        return false;
+    }
+
+    // Arguments must be received in the usual way, with any defaults being plain constants.
+
+    for (uint32_t i = 0; i < callee->num_args; i++) {
+        callee_op = &TCO_ARG_RECV_OPCODE(callee, i);
+
+        if (ZEND_ARG_SEND_MODE(&callee->arg_info[i])) {
+            return false;
+        }
+
+        if (
+            (callee_op->opcode != ZEND_RECV)
+            && (callee_op->opcode != ZEND_RECV_INIT)
+        ) {
+            return false;
+        }
+
+        if (
+            (callee_op->opcode == ZEND_RECV_INIT)
+            && (Z_TYPE_P(RT_CONSTANT(callee_op, callee_op->op2)) == IS_CONSTANT_AST)
+        ) {
+            return false;
+        }
+    }
+
+    // Finally, the body.
+
+    uint32_t body_count = 0;
+
+    for (uint32_t i = callee->num_args; i < callee->last; i++) {
+        callee_op = &callee->opcodes[i];
+
+        if (!tco_is_inlinable_op(callee_op)) {
+            return false;
+        }
+
+        if (
+            (callee_op->opcode != ZEND_NOP)
+            && (callee_op->opcode != ZEND_EXT_STMT)
+            && (++body_count > TCO_INLINE_MAX_OPS)
+        ) {
+            return false;
+        }
+
+        if (callee_op->opcode == ZEND_RETURN) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Same as tco_check_inlinable_callee, except the answer for each callee is
+ * only worked out once per compilation unit (helpers tend to be called from
+ * all over the same file).
+ */
+bool tco_is_inlinable_callee(zend_op_array *callee)
+{
+    zval *cached;
+    zval result;
+
+    if (tco_current_unit.depth == 0) {
+        return tco_check_inlinable_callee(callee);
+    }
+
+    cached = zend_hash_index_find(&tco_current_unit.inline_checks, (zend_ulong) (uintptr_t) callee);
+
+    if (cached) {
+        return Z_TYPE_P(cached) == IS_TRUE;
+    }
+
+    ZVAL_BOOL(&result, tco_check_inlinable_callee(callee));
+
+    zend_hash_index_add_new(&tco_current_unit.inline_checks, (zend_ulong) (uintptr_t) callee, &result);
+
+    return Z_TYPE(result) == IS_TRUE;
+}
+
+/*
+ * Looks for the function called by a given init opcode - provided it's one
+ * that can be inlined. That means it has to be:
+ *
+ * - Known at compile time: a plain function call (that's already been
+ *   declared), or a call to a method in the same class which can't be
+ *   overridden (i.e. private/final, or via self::).
+ * - Small & simple: no more than TCO_INLINE_MAX_OPS opcodes, with no jumps,
+ *   no calls & nothing touching anything outside its own variables (see
+ *   tco_is_inlinable_op).
+ * - Plain: no type hints, references, variadics, static variables, etc.
+ *
+ * Returns the callee's op array, or NULL if there isn't one that qualifies.
+ */
+zend_op_array *tco_find_inline_callee(zend_op_array *op_array, zend_op *op)
+{
+    zend_function *function;
+    zend_op_array *callee;
+
+    bool overridable = false;
+
+    if (op->op2_type != IS_CONST) {
+        return NULL;
+    }
+
+    switch (op->opcode) {
+        case ZEND_INIT_FCALL:
+            // (These only get emitted when the function is already known.)
+
+            function = zend_hash_find_ptr(
+                CG(function_table),
+                Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant))
+            );
+
+            break;
+
+        case ZEND_INIT_METHOD_CALL:
+        case ZEND_INIT_STATIC_METHOD_CALL:
+            // Trait methods get copied into other classes, which could have anything in them.
+
+            if (
+                !op_array->scope
+                || (op_array->scope->ce_flags & ZEND_ACC_TRAIT)
+            ) {
+                return NULL;
+            }
+
+            if (op->opcode == ZEND_INIT_METHOD_CALL) {
+                // $this->... (which needs there to be a $this).
+
+                if (
+                    (op->op1_type != IS_UNUSED)
+                    || (op_array->fn_flags & ZEND_ACC_STATIC)
+                ) {
+                    return NULL;
+                }
+
+                overridable = true;
+            } else if (op->op1_type == IS_CONST) {
+                // self:: (or the class name itself).
+
+                if (
+                    !zend_string_equals(
+                        Z_STR_P(CT_CONSTANT_EX(op_array, op->op1.constant)),
+                        op_array->scope->name
+                    )
+                ) {
+                    return NULL;
+                }
+            } else if (op->op1_type == IS_UNUSED) {
+                switch (op->op1.num & ZEND_FETCH_CLASS_MASK) {
+                    case ZEND_FETCH_CLASS_SELF:
+                        break;
+
+                    case ZEND_FETCH_CLASS_STATIC:
+                        overridable = true;
+
+                        break;
+
+                    default:
+                        return NULL;
+                }
+            } else {
+                return NULL;
+            }
+
+            // (The lowercase name is the literal after the name itself.)
+
+            function = zend_hash_find_ptr(
+                &op_array->scope->function_table,
+                Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant + 1))
+            );
+
+            if (!function) {
+                return NULL;
+            }
+
+            if (
+                (op->opcode == ZEND_INIT_STATIC_METHOD_CALL)
+                && !(function->common.fn_flags & ZEND_ACC_STATIC)
+            ) {
+                return NULL;
+            }
+
+            if (
+                overridable
+                && !(function->common.fn_flags & (ZEND_ACC_PRIVATE | ZEND_ACC_FINAL))
+                && !(op_array->scope->ce_flags & ZEND_ACC_FINAL)
+            ) {
+                return NULL;
+            }
+
+            break;
+
+        default:
+            return NULL;
+    }
+
+    if (
+        !function
+        || (function->type != ZEND_USER_FUNCTION)
+    ) {
+        return NULL;
+    }
+
+    callee = &function->op_array;
+
+    // (The callee's opcodes are copied as they are after pass two.)
+
+    if (
+        (callee == op_array)
+        || !(callee->fn_flags & ZEND_ACC_DONE_PASS_TWO)
+    ) {
+        return NULL;
+    }
+
+    return tco_is_inlinable_callee(callee) ? callee : NULL;
+}
+
+/*
+ * Determines whether the arguments of a given call can be handed to an
+ * inlined callee - i.e. they're all passed by value, there aren't any calls
+ * nested in among them, and every required argument is there.
+ */
+bool tco_can_inline_call(
+    zend_op_array *op_array,
+    zend_op_array *callee,
+    uint32_t init_index,
+    uint32_t call_index
+) {
+    zend_op *op;
+
+    uint32_t arg_index;
+
+    bool can_inline = true;
+
+    bool *args_passed = calloc(callee->num_args + 1, sizeof(bool));
+
+    for (
+        uint32_t i = init_index + 1;
+        can_inline && (i < call_index);
+        i++
+    ) {
+        op = &op_array->opcodes[i];
+
+        switch (op->opcode) {
+            case ZEND_SEND_VAR_EX:
+            case ZEND_SEND_VAL_EX:
+            case ZEND_SEND_VAR:
+            case ZEND_SEND_VAL:
+                if (op->op2_type == IS_CONST) {
+                    arg_index = tco_find_named_arg(
+                        Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant)),
+                        callee
+                    );
+
+                    // (tco_find_named_arg falls back to the first argument.)
+
+                    if (
+                        (callee->num_args == 0)
+                        || !zend_string_equals(
+                            callee->arg_info[arg_index].name,
+                            Z_STR_P(CT_CONSTANT_EX(op_array, op->op2.constant))
+                        )
+                    ) {
+                        can_inline = false;
+                    }
+                } else {
+                    arg_index = op->op2.num - 1;
+
+                    // (Extra arguments would only be visible to func_get_args() anyway.)
+
+                    if (arg_index >= callee->num_args) {
+                        can_inline = false;
+                    }
+                }
+
+                if (can_inline) {
+                    args_passed[arg_index] = true;
+                }
+
+                break;
+
+            case ZEND_SEND_REF:
+            case ZEND_SEND_VAR_NO_REF:
+            case ZEND_SEND_VAR_NO_REF_EX:
+            case ZEND_SEND_FUNC_ARG:
+            case ZEND_SEND_UNPACK:
+            case ZEND_SEND_ARRAY:
+            case ZEND_SEND_USER:
+            case ZEND_DO_ICALL:
+            case ZEND_DO_UCALL:
+            case ZEND_DO_FCALL:
+            case ZEND_DO_FCALL_BY_NAME:
+                // Anything passed by reference, unpacked, or the result of another call.
+
+                can_inline = false;
+
+                break;
+        }
+    }
+
+    for (arg_index = 0; can_inline && (arg_index < callee->required_num_args); arg_index++) {
+        if (!args_passed[arg_index]) {
+            // (Left alone, this would be an ArgumentCountError.)
+
+            can_inline = false;
+        }
+    }
+
+    free(args_passed);
+
+    return can_inline;
+}
+
+/*
+ * Determines whether a call passes any of its arguments in a way the rewrite
+ * can't follow: by reference, unpacked, or "maybe by reference" (when the
+ * callee isn't known at compile time) - which needs the call's frame to exist.
+ *
+ * (Calls nested among the arguments keep their frames, so their sends are fine.)
+ */
+bool tco_has_unsupported_sends(zend_op_array *op_array, uint32_t init_index, uint32_t call_index)
+{
+    uint32_t depth = 0;
+
+    for (uint32_t i = init_index + 1; i < call_index; i++) {
+        switch (op_array->opcodes[i].opcode) {
+            case ZEND_INIT_NS_FCALL_BY_NAME:
+            case ZEND_INIT_METHOD_CALL:
+            case ZEND_INIT_STATIC_METHOD_CALL:
+            case ZEND_INIT_FCALL:
+            case ZEND_INIT_FCALL_BY_NAME:
+            case ZEND_INIT_DYNAMIC_CALL:
+            case ZEND_INIT_USER_CALL:
+            case ZEND_NEW:
+                ++depth;
+
+                break;
+
+#ifdef ZEND_CALLABLE_CONVERT
+            case ZEND_CALLABLE_CONVERT:
+#endif
+            case ZEND_DO_ICALL:
+            case ZEND_DO_UCALL:
+            case ZEND_DO_FCALL:
+            case ZEND_DO_FCALL_BY_NAME:
+                if (depth > 0) {
+                    --depth;
+                }
+
+                break;
+
+            case ZEND_SEND_FUNC_ARG:
+            case ZEND_CHECK_FUNC_ARG:
+            case ZEND_FETCH_FUNC_ARG:
+            case ZEND_FETCH_DIM_FUNC_ARG:
+            case ZEND_FETCH_OBJ_FUNC_ARG:
+            case ZEND_FETCH_STATIC_PROP_FUNC_ARG:
+            case ZEND_SEND_REF:
+            case ZEND_SEND_VAR_NO_REF:
+            case ZEND_SEND_VAR_NO_REF_EX:
+            case ZEND_SEND_UNPACK:
+            case ZEND_SEND_ARRAY:
+            case ZEND_SEND_USER:
+                if (depth == 0) {
+                    return true;
+                }
+
+                break;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Looks for recursive calls which can be optimised - i.e. those in tail
+ * position, plus (if the function has opted in to the explicit stack) any
+ * others, e.g. f($l) + f($r).
+ *
+ * If the context allows it, non-recursive calls in tail position to functions
+ * small enough to be inlined are picked up too (see tco_find_inline_callee).
+ *
+ * Returns the number of call sites found.
+ */
+uint32_t tco_find_recursive_calls(tco_context *context, tco_call_site *call_sites)
+{
+    zend_op *op;
+    zend_op_array *callee;
+
+    zend_op_array *op_array = context->op_array;
+
+    bool allow_inline = context->inline_calls;
+
+    uint32_t init_index;
+    uint32_t last_index;
+    uint32_t frame_layout;
+
+    uint32_t sites_found = 0;
+
+    bool is_generator = (op_array->fn_flags & ZEND_ACC_GENERATOR);
+    bool is_flat_generator = is_generator && !tco_has_auto_keys(op_array);
+    bool wants_explicit_stack = tco_wants_explicit_stack(op_array);
+    bool dynamic_cvs = wants_explicit_stack && tco_has_dynamic_cvs(op_array);
+
+    /*
+     * Inlined code returns straight from the caller - so it'd skip past the
+     * caller's own return type check. (Generators & the explicit stack each
+     * have their own ideas about returns, too.)
+     */
+
+    if (
+        is_generator
+        || wants_explicit_stack
+        || (op_array->fn_flags & ZEND_ACC_HAS_RETURN_TYPE)
+    ) {
+        allow_inline = false;
+    }
+
+    // Calls can be nested (e.g. as arguments) - so we track which inits are still open.
+
+    uint32_t *open_inits = context->open_inits = tco_grow_buffer(
+        context->open_inits,
+        &context->open_inits_size,
+        op_array->last,
+        sizeof(uint32_t)
+    );
+
+    uint32_t depth = 0;
+
+    for (uint32_t i = 0; i < op_array->last; i++) {
+        op = &op_array->opcodes[i];
+
+        switch (op->opcode) {
+            case ZEND_INIT_NS_FCALL_BY_NAME:
+            case ZEND_INIT_METHOD_CALL:
+            case ZEND_INIT_STATIC_METHOD_CALL:
+            case ZEND_INIT_FCALL:
+            case ZEND_INIT_FCALL_BY_NAME:
+            case ZEND_INIT_DYNAMIC_CALL:
+            case ZEND_INIT_USER_CALL:
+            case ZEND_NEW:
+                open_inits[depth++] = i;
+
+                break;
+
+#ifdef ZEND_CALLABLE_CONVERT
+            case ZEND_CALLABLE_CONVERT:
+                // First-class callable syntax (f(...)) closes its init without a call.
+
+                if (depth > 0) {
+                    --depth;
+                }
+
+                break;
+#endif
+
+            case ZEND_DO_ICALL:
+            case ZEND_DO_UCALL:
+            case ZEND_DO_FCALL:
+            case ZEND_DO_FCALL_BY_NAME:
+                if (depth == 0) {
+                    // (Shouldn't happen, but there's no init to match.)
+
+                    break;
+                }
+
+                init_index = open_inits[--depth];
+
+                /*
+                 * Calls nested inside another call can't be used - their
+                 * result is passed on (so they're not tail calls) and the
+                 * outer call's frame would be left dangling on the VM stack
+                 * while we loop.
+                 */
+
+                if (depth > 0) {
+                    break;
+                }
+
+                if (!tco_is_call_recursive(op_array, &op_array->opcodes[init_index])) {
+                    // Not recursive - but it might still be worth inlining.
+
+                    if (!allow_inline) {
+                        break;
+                    }
+
+                    callee = tco_find_inline_callee(op_array, &op_array->opcodes[init_index]);
+
+                    if (
+                        !callee
+                        || !tco_can_inline_call(op_array, callee, init_index, i)
+                    ) {
+                        break;
+                    }
+
+                    last_index = tco_find_tail_return(op_array, i);
+
+                    if (!last_index) {
+                        break;
+                    }
+
+                    call_sites[sites_found].init_index = init_index;
+                    call_sites[sites_found].call_index = i;
+                    call_sites[sites_found].last_index = last_index;
+                    call_sites[sites_found].push_frame = false;
+                    call_sites[sites_found].frame_layout = TCO_NO_LAYOUT;
+                    call_sites[sites_found].callee = callee;
+
+                    ++sites_found;
+
+                    break;
+                }
+
+                // (The rewrite only knows how to move plainly sent arguments.)
+
+                if (tco_has_unsupported_sends(op_array, init_index, i)) {
+                    break;
+                }
+
+                /*
+                 * In a generator, returning a call's result doesn't delegate
+                 * to it - the call's generator just becomes the return value.
+                 * The only "tail call" there is a yield from right before
+                 * returning, which can be flattened into the same loop
+                 * (keeping everything inside the one generator frame).
+                 *
+                 * Generated keys would carry on counting across what used to
+                 * be separate generators, though (rather than restarting from
+                 * 0) - so generators with any are left as they are.
+                 */
+
+                if (is_generator) {
+                    if (!is_flat_generator) {
+                        break;
+                    }
+
+                    last_index = tco_find_delegated_return(op_array, i);
+                } else {
+                    last_index = tco_find_tail_return(op_array, i);
+                }
+
+                if (last_index) {
+                    call_sites[sites_found].push_frame = false;
+                    call_sites[sites_found].frame_layout = TCO_NO_LAYOUT;
+                } else if (wants_explicit_stack) {
+                    // Not a tail call, so it'll need the explicit stack (if it can have it).
+
+                    frame_layout = tco_plan_frame_layout(op_array, init_index, i, dynamic_cvs);
+
+                    if (frame_layout == TCO_NO_LAYOUT) {
+                        break;
+                    }
+
+                    last_index = i;
+
+                    call_sites[sites_found].push_frame = true;
+                    call_sites[sites_found].frame_layout = frame_layout;
+                } else {
+                    break;
+                }
+
+                call_sites[sites_found].init_index = init_index;
+                call_sites[sites_found].call_index = i;
+                call_sites[sites_found].last_index = last_index;
+                call_sites[sites_found].callee = NULL;
+
+                ++sites_found;
+
+                break;
+        }
+    }
+
+    return sites_found;
+}
+
+/*
+ * Analyses the op array, looking for & optimising any recursive function calls.
+ */
+void tco_analyse(tco_context *context)
+{
+    uint32_t i;
+
+    zend_op_array *op_array = context->op_array;
+
+    // I think all op arrays are guaranteed to have at least one opcode, but just in case...
+
+    if (op_array->last < 1) {
+        // If there are no opcodes, there's nothing to do.
+
+        return;
+    }
+
+    /*
+     * First, we need to iterate "forwards" over the opcodes, looking for where
+     * the various recv opcodes end - because we need this starting address
+     * so that we know where to jump (back) to for each reiteration.
+     *
+     * (This could/should maybe be deferred & done elsewhere.)
+     */
+
+    bool found_start_address = false;
+
+    for (
+        i = 0;
+        (i < op_array->last) && !found_start_address;
+        i++
+    ) {
+        switch (op_array->opcodes[i].opcode) {
+            case ZEND_RECV_INIT:
+            case ZEND_RECV:
+            // (Generators need to jump back to after the generator gets created.)
+            case ZEND_GENERATOR_CREATE:
+                break;
+
+            default:
+                /*
+                 * If we're here, context->start_address should be pointing to
+                 * the address of the first opcode of the function, sans any
+                 * initialisation, etc.
+                 */
+
+                context->start_address = i;
+
+                found_start_address = true;
+        }
+    }
+
+    /*
+     * Now find every call site worth optimising. These are all found before
+     * any are optimised - because optimising a call shuffles opcodes around,
+     * and following a call's result may well pass through another call's
+     * opcodes. (The calls themselves never overlap, so the indices will
+     * still be good afterwards.)
+     */
+
+    tco_call_site *call_sites = context->call_sites = tco_grow_buffer(
+        context->call_sites,
+        &context->call_sites_size,
+        op_array->last,
+        sizeof(tco_call_site)
+    );
+
+    uint32_t sites_found = tco_find_recursive_calls(context, call_sites);
+
+    // Calls needing the explicit stack also need somewhere to track its depth.
+
+    for (i = 0; i < sites_found; i++) {
+        if (call_sites[i].push_frame) {
+            context->stack_cv = tco_add_stack_cv(op_array);
+
+            break;
+        }
+    }
+
+    // Tail calls can leave a note of each iteration behind, for backtraces.
+
+    if (TCO_SHADOW_FRAMES > 0) {
+        for (i = 0; i < sites_found; i++) {
+            if (!call_sites[i].push_frame && !call_sites[i].callee) {
+                context->shadow_cv = tco_add_cv(
+                    op_array,
+                    zend_string_init(TCO_SHADOW_CV_NAME, sizeof(TCO_SHADOW_CV_NAME) - 1, 0)
+                );
+
+                break;
+            }
+        }
+    }
+
+    // With enough calls, they can share a single re-entry block. (Not when
+    // frames get pushed, though - the push moves the arguments out of the
+    // way, so every one of them needs assigning, every time.)
+
+    uint32_t shared_sites = 0;
+
+    for (i = 0; i < sites_found; i++) {
+        if (call_sites[i].push_frame) {
+            shared_sites = 0;
+
+            break;
+        }
+
+        if (!call_sites[i].callee) {
+            ++shared_sites;
+        }
+    }
+
+    if (
+        (TCO_SHARED_REENTRY_SITES > 0)
+        && (shared_sites >= TCO_SHARED_REENTRY_SITES)
+        && (op_array->num_args > 0)
+    ) {
+        // (The holding T vars share the allocation - see tco_build_shared_moves.)
+
+        context->reentry_stages = malloc(sizeof(uint32_t) * op_array->num_args * 2);
+        context->reentry_holds = context->reentry_stages + op_array->num_args;
+    }
+
+    for (i = 0; i < sites_found; i++) {
+        tco_optimise_recursive_call(
+            context,
+            call_sites[i].init_index,
+            call_sites[i].call_index,
+            call_sites[i].last_index,
+            call_sites[i].push_frame,
+            call_sites[i].frame_layout,
+            call_sites[i].callee
+        );
+    }
+
+    if (context->reentry_stages) {
+        tco_plan_reentry(context);
+    }
+}
+
+/*
+ * Rewrites every (remaining) return in the op array to pop an explicit stack
+ * frame, if there's one to pop.
+ *
+ * This has to happen after compilation - by which point any returns that
+ * belonged to tail calls will have been overwritten.
+ */
+void tco_compile_frame_returns(tco_context *context)
+{
+    zend_op_array *op_array = context->op_array;
+
+    for (uint32_t i = 0; i < op_array->last; i++) {
+        if (op_array->opcodes[i].opcode == ZEND_RETURN) {
+            tco_make_pop_frame(&op_array->opcodes[i], context->stack_cv);
+        }
+    }
+}
+
+/*
+ * Returns the explicit stack for whatever's running right now.
+ *
+ * Each fiber gets a stack of its own. (Otherwise, while one was suspended
+ * mid-recursion, another could push & pop right over the top of its frames.)
+ */
+static tco_frame_stack *tco_get_frames(void)
+{
+#if PHP_VERSION_ID >= 80100
+    tco_frame_stack *stack;
+
+    zend_fiber *fiber = EG(active_fiber);
+
+    if (fiber) {
+        if (!tco_fiber_frames) {
+            ALLOC_HASHTABLE(tco_fiber_frames);
+            zend_hash_init(tco_fiber_frames, 8, NULL, NULL, 0);
+        }
+
+        stack = zend_hash_index_find_ptr(tco_fiber_frames, (zend_ulong) (uintptr_t) fiber);
+
+        if (!stack) {
+            stack = ecalloc(1, sizeof(tco_frame_stack));
+
+            zend_hash_index_add_new_ptr(tco_fiber_frames, (zend_ulong) (uintptr_t) fiber, stack);
+        }
+
+        return stack;
+    }
+#endif
+
+    return &tco_frames;
+}
+
+/*
+ * Makes sure a given stack has room for 1 more frame (& its slots).
+ * Returns a pointer to the (uninitialised) frame.
+ */
+tco_frame *tco_reserve_frame(tco_frame_stack *stack, uint32_t slot_count)
+{
+    // Grow the frames & slots independently - doubling each time, as required.
+
+    if (stack->top >= stack->size) {
+        stack->size = stack->size ? (stack->size * 2) : TCO_FRAME_POOL_SIZE;
+        stack->frames = erealloc(stack->frames, sizeof(tco_frame) * stack->size);
+    }
+
+    while ((stack->slots_top + slot_count) > stack->slots_size) {
+        stack->slots_size = stack->slots_size ? (stack->slots_size * 2) : TCO_FRAME_POOL_SIZE;
+        stack->slots = erealloc(stack->slots, sizeof(zval) * stack->slots_size);
+        stack->slot_kinds = erealloc(stack->slot_kinds, sizeof(zend_uchar) * stack->slots_size);
+    }
+
+    tco_frame *frame = &stack->frames[stack->top++];
+
+    frame->slots_start = stack->slots_top;
+    frame->slot_count = slot_count;
+
+    stack->slots_top += slot_count;
+
+    return frame;
+}
+
+/*
+ * Lets go of whatever's held in a slot of a frame that's being discarded.
+ * (This is the same as Zend does for live variables when unwinding.)
+ */
+void tco_release_slot(zval *value, zend_uchar kind)
+{
+    if (Z_TYPE_P(value) == IS_UNDEF) {
+        return;
+    }
+
+    switch (kind) {
+        case TCO_SLOT_RAW:
+            break;
+
+        case TCO_SLOT_LOOP:
+            if (
+                (Z_TYPE_P(value) != IS_ARRAY)
+                && (Z_FE_ITER_P(value) != (uint32_t) -1)
+            ) {
+                zend_hash_iterator_del(Z_FE_ITER_P(value));
+            }
+
+            zval_ptr_dtor_nogc(value);
+
+            break;
+
+        default:
+            zval_ptr_dtor(value);
+    }
+}
+
+/*
+ * Discards every frame of a given stack at or above the given index.
+ *
+ * Frames are normally popped by returns - but if an exception unwinds a
+ * function, its frames are left behind. Those get cleaned up here, the next
+ * time something further down the stack pushes or pops - or anything at all
+ * pushes its first frame (see tco_find_stale_frames).
+ *
+ * Releasing a slot can run a destructor, which can push frames of its own -
+ * so nothing is held on to across a release, and frames are only dropped
+ * once they're empty.
+ */
+void tco_truncate_frames(tco_frame_stack *stack, uint32_t index)
+{
+    zval value;
+
+    uint32_t top;
+    uint32_t slots_start;
+    uint32_t slot_count;
+
+    while (stack->top > index) {
+        top = stack->top;
+
+        slots_start = stack->frames[top - 1].slots_start;
+        slot_count = stack->frames[top - 1].slot_count;
+
+        for (uint32_t i = 0; i < slot_count; i++) {
+            // (The whole zval is copied - a foreach keeps its position in the spare bits.)
+
+            value = stack->slots[slots_start + i];
+
+            ZVAL_UNDEF(&stack->slots[slots_start + i]);
+
+            tco_release_slot(&value, stack->slot_kinds[slots_start + i]);
+        }
+
+        // (If a destructor left frames above this one, they go first - & then this one's revisited.)
+
+        if (stack->top == top) {
+            stack->top = top - 1;
+            stack->slots_top = slots_start;
+        }
+    }
+}
+
+/*
+ * Finds where the frames left behind by invocations that have since been
+ * unwound (e.g. by an exception) start - i.e. the first frame whose owner
+ * isn't among the callers of a given invocation, which is about to push its
+ * first frame. (So it has no frames yet - any claiming to be its own are
+ * left over from an earlier invocation at the same address.)
+ */
+uint32_t tco_find_stale_frames(tco_frame_stack *stack, zend_execute_data *execute_data)
+{
+    zend_execute_data *owner = NULL;
+    zend_execute_data *call;
+
+    for (uint32_t i = 0; i < stack->top; i++) {
+        // (Each invocation's frames are all together, so its owner only needs finding once.)
+
+        if (stack->frames[i].owner == owner) {
+            continue;
+        }
+
+        owner = stack->frames[i].owner;
+
+        for (
+            call = EX(prev_execute_data);
+            call && (call != owner);
+            call = call->prev_execute_data
+        );
+
+        if (!call) {
+            return i;
+        }
+    }
+
+    return stack->top;
+}
+
+/*
+ * Releases the dead CVs in a given layout (i.e. those not used after the
+ * call) - see tco_plan_frame_layout.
+ */
+void tco_release_dead_cvs(zend_execute_data *execute_data, const uint32_t *dead, uint32_t dead_count)
+{
+    zval value;
+    zval *var;
+
+    for (uint32_t i = 0; i < dead_count; i++) {
+        var = EX_VAR_NUM(TCO_SLOT_NUM(dead[i]));
+
+        ZVAL_COPY_VALUE(&value, var);
+        ZVAL_UNDEF(var);
+
+        zval_ptr_dtor(&value);
+    }
+}
+
+/*
+ * Pushes a frame to the explicit stack - moving the CVs & T vars that'll be
+ * needed once the call returns into it (& releasing any other CVs) - then
+ * carries on to the argument assignments.
+ */
+static int tco_push_frame(zend_execute_data *execute_data)
+{
+    zval *var;
+
+    const zend_op *opline = EX(opline);
+    zend_op_array *op_array = &EX(func)->op_array;
+
+    const uint32_t *layout = (const uint32_t *) Z_STRVAL_P(RT_CONSTANT(opline, opline->op1));
+
+    tco_frame_stack *stack = tco_get_frames();
+
+    zval *depth = EX_VAR(opline->op2.var);
+
+    /*
+     * If this invocation has no frames yet, its first frame goes on top of
+     * whatever's still in use. (Without this, an invocation that keeps
+     * catching exceptions from a function using the stack would have its
+     * frames pile up until the request ends.) Otherwise it goes directly
+     * above its previous frame.
+     */
+
+    bool is_first = (Z_TYPE_P(depth) != IS_LONG);
+    uint32_t index;
+
+    if (is_first) {
+        tco_truncate_frames(stack, tco_find_stale_frames(stack, execute_data));
+
+        index = stack->top;
+    } else {
+        index = (uint32_t) (Z_LVAL_P(depth) + 1);
+
+        tco_truncate_frames(stack, index);
+    }
+
+    tco_frame *frame = tco_reserve_frame(stack, layout[1]);
+    zval *slots = stack->slots + frame->slots_start;
+    zend_uchar *slot_kinds = stack->slot_kinds + frame->slots_start;
+
+    frame->owner = execute_data;
+    frame->layout = layout + TCO_LAYOUT_HEADER;
+    frame->resume_index = layout[0];
+    frame->result_type = opline->result_type;
+    frame->result_var = opline->result.var;
+    frame->is_first = is_first;
+    frame->dead_count = layout[2];
+
+    // Everything's moved, rather than copied - so nothing gains a reference.
+
+    for (uint32_t i = 0; i < frame->slot_count; i++) {
+        slot_kinds[i] = TCO_SLOT_KIND(frame->layout[i]);
+
+        if (slot_kinds[i] == TCO_SLOT_CV) {
+            var = EX_VAR_NUM(TCO_SLOT_NUM(frame->layout[i]));
+
+            ZVAL_COPY_VALUE(&slots[i], var);
+            ZVAL_UNDEF(var);
+        } else {
+            // (The whole zval - a foreach keeps its position in the spare bits.)
+
+            var = EX_VAR_NUM(op_array->last_var + TCO_SLOT_NUM(frame->layout[i]));
+
+            slots[i] = *var;
+
+            /*
+             * The frame owns it now - so if a dead CV's destructor throws
+             * (below), unwinding this invocation mustn't release it too.
+             * (Raw values aren't released by unwinding anyway.)
+             */
+
+            if (slot_kinds[i] == TCO_SLOT_LOOP) {
+                ZVAL_UNDEF(var);
+                Z_FE_ITER_P(var) = (uint32_t) -1;
+            } else if (slot_kinds[i] == TCO_SLOT_TMP) {
+                ZVAL_UNDEF(var);
+            }
+        }
+    }
+
+    // (Likewise, the call's result isn't there yet - so there's nothing to release.)
+
+    if (opline->result_type & (IS_TMP_VAR | IS_VAR)) {
+        ZVAL_UNDEF(EX_VAR(opline->result.var));
+    }
+
+    ZVAL_LONG(depth, index);
+
+    EX(opline) = opline + 1;
+
+    // Dead CVs go last - a destructor could throw (which needs EX(opline) to be up to date).
+
+    tco_release_dead_cvs(execute_data, frame->layout + frame->slot_count, frame->dead_count);
+
+    return ZEND_USER_OPCODE_CONTINUE;
+}
+
+/*
+ * Pops a frame from the explicit stack & resumes the invocation it belonged
+ * to - or, if there are no frames, returns as normal.
+ */
+static int tco_pop_frame(zend_execute_data *execute_data)
+{
+    zval return_value;
+    zval value;
+    zval *var;
+
+    const zend_op *opline = EX(opline);
+    zend_op_array *op_array = &EX(func)->op_array;
+
+    zval *depth = EX_VAR(opline->op2.var);
+
+    if (Z_TYPE_P(depth) != IS_LONG) {
+        return ZEND_USER_OPCODE_DISPATCH_TO | ZEND_RETURN;
+    }
+
+    tco_frame_stack *stack = tco_get_frames();
+
+    uint32_t index = (uint32_t) Z_LVAL_P(depth);
+
+    // (This should never happen, but better to return than resume garbage.)
+
+    if (
+        (index >= stack->top)
+        || (stack->frames[index].owner != execute_data)
+    ) {
+        ZVAL_UNDEF(depth);
+
+        return ZEND_USER_OPCODE_DISPATCH_TO | ZEND_RETURN;
+    }
+
+    tco_truncate_frames(stack, index + 1);
+
+    // Take the return value first (it may well live in a CV we're about to restore).
+
+    switch (opline->op1_type) {
+        case IS_CONST:
+            ZVAL_COPY(&return_value, RT_CONSTANT(opline, opline->op1));
+            break;
+
+        case IS_TMP_VAR:
+            ZVAL_COPY_VALUE(&return_value, EX_VAR(opline->op1.var));
+            break;
+
+        case IS_VAR:
+            ZVAL_COPY_DEREF(&return_value, EX_VAR(opline->op1.var));
+            zval_ptr_dtor_nogc(EX_VAR(opline->op1.var));
+            break;
+
+        default:
+            ZVAL_COPY_DEREF(&return_value, EX_VAR(opline->op1.var));
+
+            if (Z_TYPE(return_value) == IS_UNDEF) {
+                ZVAL_NULL(&return_value);
+            }
+    }
+
+    // (Only now - taking the return value could have run a destructor, & moved the stack.)
+
+    tco_frame *frame = &stack->frames[index];
+    zval *slots = stack->slots + frame->slots_start;
+
+    /*
+     * Put the CVs & T vars back how they were. Whatever the returning
+     * invocation left in the CVs is swapped into the frame, so it gets
+     * released along with the frame (once everything else is in place).
+     */
+
+    for (uint32_t i = 0; i < frame->slot_count; i++) {
+        if (TCO_SLOT_KIND(frame->layout[i]) == TCO_SLOT_CV) {
+            var = EX_VAR_NUM(TCO_SLOT_NUM(frame->layout[i]));
+
+            ZVAL_COPY_VALUE(&value, var);
+            ZVAL_COPY_VALUE(var, &slots[i]);
+            ZVAL_COPY_VALUE(&slots[i], &value);
+        } else {
+            *EX_VAR_NUM(op_array->last_var + TCO_SLOT_NUM(frame->layout[i])) = slots[i];
+
+            ZVAL_UNDEF(&slots[i]);
+        }
+    }
+
+    // The return value goes where the original call's result would have.
+
+    bool keep_result = (frame->result_type & (IS_TMP_VAR | IS_VAR));
+
+    if (keep_result) {
+        ZVAL_COPY_VALUE(EX_VAR(frame->result_var), &return_value);
+    }
+
+    if (frame->is_first) {
+        ZVAL_UNDEF(depth);
+    } else {
+        ZVAL_LONG(depth, index - 1);
+    }
+
+    EX(opline) = op_array->opcodes + frame->resume_index;
+
+    // Now the returning invocation's variables can be let go of.
+
+    const uint32_t *dead = frame->layout + frame->slot_count;
+    uint32_t dead_count = frame->dead_count;
+
+    tco_truncate_frames(stack, index);
+    tco_release_dead_cvs(execute_data, dead, dead_count);
+
+    if (!keep_result) {
+        zval_ptr_dtor(&return_value);
+    }
+
+    return ZEND_USER_OPCODE_CONTINUE;
+}
+
+/*
+ * Lets go of the arguments held by a shadow frame.
+ */
+static void tco_release_shadow_frame(tco_shadow_frame *frame)
+{
+    for (uint32_t i = 0; i < frame->num_args; i++) {
+        zval_ptr_dtor(&frame->args[i]);
+    }
+
+    frame->num_args = 0;
+}
+
+/*
+ * Records a shadow frame for the current iteration (see TCO_SHADOW_FRAMES) -
+ * overwriting the oldest, once the ring is full.
+ *
+ * This runs every iteration, so it's kept to a handful of copies: no
+ * allocations (bar the ring itself, once per request).
+ */
+static int tco_record_shadow_frame(zend_execute_data *execute_data)
+{
+    const zend_op *opline = EX(opline);
+    zend_op_array *op_array = &EX(func)->op_array;
+
+    zval *serial = EX_VAR(opline->op2.var);
+    zval *arg;
+
+    if (!tco_shadow.frames) {
+        tco_shadow.frames = ecalloc(TCO_SHADOW_FRAMES, sizeof(tco_shadow_frame));
+    }
+
+    if (Z_TYPE_P(serial) != IS_LONG) {
+        ZVAL_LONG(serial, ++tco_shadow.serial);
+    }
+
+    tco_shadow_frame *frame = &tco_shadow.frames[tco_shadow.next];
+
+    tco_shadow.next = (tco_shadow.next + 1) % TCO_SHADOW_FRAMES;
+
+    if (tco_shadow.count < TCO_SHADOW_FRAMES) {
+        ++tco_shadow.count;
+    }
+
+    tco_release_shadow_frame(frame);
+
+    frame->owner = execute_data;
+    frame->serial = Z_LVAL_P(serial);
+    frame->lineno = opline->lineno;
+    frame->num_args = MIN(op_array->num_args, TCO_SHADOW_ARGS);
+
+    for (uint32_t i = 0; i < frame->num_args; i++) {
+        arg = EX_VAR_NUM(i);
+
+        ZVAL_DEREF(arg);
+
+        /*
+         * Holding on to an array would mean the next write to it has to
+         * separate (copy) it - every iteration. Traces only ever print
+         * arrays as "Array" anyway, so that's all that's kept.
+         *
+         * Same goes for strings (e.g. an accumulator being appended to) -
+         * only the start of those gets printed, so that's copied into the
+         * frame itself (& left undefined here - see tco_add_trace_frame).
+         */
+
+        if (
+            (Z_TYPE_P(arg) == IS_ARRAY)
+            && Z_REFCOUNTED_P(arg)
+        ) {
+            ZVAL_INTERNED_STR(&frame->args[i], ZSTR_KNOWN(ZEND_STR_ARRAY_CAPITALIZED));
+        } else if (
+            (Z_TYPE_P(arg) == IS_STRING)
+            && Z_REFCOUNTED_P(arg)
+        ) {
+            size_t len = MIN(Z_STRLEN_P(arg), TCO_SHADOW_STRING_LEN);
+
+            memcpy(frame->strings[i], Z_STRVAL_P(arg), len);
+
+            if (len < Z_STRLEN_P(arg)) {
+                memcpy(frame->strings[i] + len, "...", 3);
+                len += 3;
+            }
+
+            frame->string_lens[i] = (uint32_t) len;
+
+            ZVAL_UNDEF(&frame->args[i]);
+        } else if (Z_TYPE_P(arg) == IS_UNDEF) {
+            ZVAL_NULL(&frame->args[i]);
+        } else {
+            ZVAL_COPY(&frame->args[i], arg);
+        }
+    }
+
+    EX(opline) = opline + 1;
+
+    return ZEND_USER_OPCODE_CONTINUE;
+}
+
+/*
+ * Handler for ZEND_TICKS. Hands our own "virtual" opcodes off to the
+ * appropriate function - and anything else to whoever was there before.
+ */
+static int tco_ticks_handler(zend_execute_data *execute_data)
+{
+    switch (EX(opline)->extended_value) {
+        case TCO_OPLINE_PUSH_FRAME:
+            return tco_push_frame(execute_data);
+
+        case TCO_OPLINE_POP_FRAME:
+            return tco_pop_frame(execute_data);
+
+        case TCO_OPLINE_SHADOW_FRAME:
+            return tco_record_shadow_frame(execute_data);
+    }
+
+    if (tco_previous_ticks_handler) {
+        return tco_previous_ticks_handler(execute_data);
+    }
+
+    return ZEND_USER_OPCODE_DISPATCH;
+}
+
+/*
+ * Finds the shadow frames recorded by a given invocation (oldest first) &
+ * returns how many there are.
+ */
+static uint32_t tco_find_shadow_frames(zend_execute_data *call, tco_shadow_frame **found)
+{
+    zend_op_array *op_array;
+    tco_shadow_frame *frame;
+
+    zval *serial = NULL;
+
+    uint32_t count = 0;
+
+    if (
+        !call->func
+        || !ZEND_USER_CODE(call->func->type)
+    ) {
+        return 0;
+    }
+
+    op_array = &call->func->op_array;
+
+    for (uint32_t i = 0; i < op_array->last_var; i++) {
+        if (zend_string_equals_literal(op_array->vars[i], TCO_SHADOW_CV_NAME)) {
+            serial = ZEND_CALL_VAR_NUM(call, i);
+
+            break;
+        }
+    }
+
+    if (
+        !serial
+        || (Z_TYPE_P(serial) != IS_LONG)
+    ) {
+        return 0;
+    }
+
+    // (The oldest frame is count frames behind the next one to be written.)
+
+    uint32_t oldest = (tco_shadow.next + TCO_SHADOW_FRAMES - tco_shadow.count) % TCO_SHADOW_FRAMES;
+
+    for (uint32_t i = 0; i < tco_shadow.count; i++) {
+        frame = &tco_shadow.frames[(oldest + i) % TCO_SHADOW_FRAMES];
+
+        if (
+            (frame->owner == call)
+            && (frame->serial == Z_LVAL_P(serial))
+        ) {
+            found[count++] = frame;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Adds a copy of a given backtrace frame to a trace - optionally moved to a
+ * different file/line, and with a shadow frame's arguments.
+ */
+static void tco_add_trace_frame(
+    zval *trace,
+    zval *frame,
+    zend_string *file,
+    uint32_t lineno,
+    tco_shadow_frame *shadow_frame
+) {
+    zval copy;
+    zval value;
+
+    ZVAL_ARR(&copy, zend_array_dup(Z_ARRVAL_P(frame)));
+
+    if (file) {
+        ZVAL_STR_COPY(&value, file);
+        zend_hash_update(Z_ARRVAL(copy), ZSTR_KNOWN(ZEND_STR_FILE), &value);
+
+        ZVAL_LONG(&value, lineno);
+        zend_hash_update(Z_ARRVAL(copy), ZSTR_KNOWN(ZEND_STR_LINE), &value);
+    }
+
+    // (Arguments are only filled in if the trace has them in the first place.)
+
+    if (
+        shadow_frame
+        && zend_hash_exists(Z_ARRVAL(copy), ZSTR_KNOWN(ZEND_STR_ARGS))
+    ) {
+        array_init_size(&value, shadow_frame->num_args);
+
+        zval arg;
+
+        for (uint32_t i = 0; i < shadow_frame->num_args; i++) {
+            if (Z_ISUNDEF(shadow_frame->args[i])) {
+                ZVAL_STRINGL(&arg, shadow_frame->strings[i], shadow_frame->string_lens[i]);
+            } else {
+                ZVAL_COPY(&arg, &shadow_frame->args[i]);
+            }
+
+            zend_hash_next_index_insert_new(Z_ARRVAL(value), &arg);
+        }
+
+        zend_hash_update(Z_ARRVAL(copy), ZSTR_KNOWN(ZEND_STR_ARGS), &value);
+    }
+
+    zend_hash_next_index_insert_new(Z_ARRVAL_P(trace), &copy);
+}
+
+/*
+ * Merges shadow frames into a backtrace (as built by zend_fetch_debug_backtrace,
+ * starting from the given call).
+ *
+ * A rewritten function only has 1 real frame, showing where it was first
+ * called from & its current arguments. With shadow frames f1 ... fN (oldest
+ * first), that becomes N + 1 frames - as if the recursion had really
+ * happened:
+ *
+ *     f(current arguments)   called from fN's line
+ *     f(fN's arguments)      called from fN-1's line
+ *     ...
+ *     f(f1's arguments)      called from wherever f was first called
+ *
+ * Returns whether anything was merged.
+ */
+static bool tco_merge_shadow_frames(zval *trace, zend_execute_data *call)
+{
+    zval merged;
+    zval *frame;
+    zval *name;
+
+    zend_execute_data *next;
+    zend_string *file;
+
+    uint32_t count;
+    uint32_t i;
+
+    bool any_merged = false;
+
+    if (
+        !tco_shadow.count
+        || (Z_TYPE_P(trace) != IS_ARRAY)
+    ) {
+        return false;
+    }
+
+    tco_shadow_frame **found = emalloc(sizeof(tco_shadow_frame *) * TCO_SHADOW_FRAMES);
+
+    array_init_size(&merged, zend_hash_num_elements(Z_ARRVAL_P(trace)));
+
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(trace), frame) {
+        count = 0;
+        next = NULL;
+
+        /*
+         * The trace's frames are in the same order as the calls - so each
+         * can be matched up with the next call to the same function.
+         * (Frames without one, e.g. includes, are just skipped over.)
+         */
+
+        name = (Z_TYPE_P(frame) == IS_ARRAY)
+            ? zend_hash_find(Z_ARRVAL_P(frame), ZSTR_KNOWN(ZEND_STR_FUNCTION))
+            : NULL;
+
+        if (name && (Z_TYPE_P(name) == IS_STRING)) {
+            for (next = call; next; next = next->prev_execute_data) {
+                if (
+                    next->func
+                    && next->func->common.function_name
+                    && zend_string_equals(next->func->common.function_name, Z_STR_P(name))
+                ) {
+                    count = tco_find_shadow_frames(next, found);
+                    call = next->prev_execute_data;
+
+                    break;
+                }
+            }
+        }
+
+        if (count == 0) {
+            Z_TRY_ADDREF_P(frame);
+            zend_hash_next_index_insert_new(Z_ARRVAL(merged), frame);
+
+            continue;
+        }
+
+        file = next->func->op_array.filename;
+
+        tco_add_trace_frame(&merged, frame, file, found[count - 1]->lineno, NULL);
+
+        for (i = count - 1; i > 0; i--) {
+            tco_add_trace_frame(&merged, frame, file, found[i - 1]->lineno, found[i]);
+        }
+
+        tco_add_trace_frame(&merged, frame, NULL, 0, found[0]);
+
+        any_merged = true;
+    } ZEND_HASH_FOREACH_END();
+
+    efree(found);
+
+    if (!any_merged) {
+        zval_ptr_dtor(&merged);
+
+        return false;
+    }
+
+    zval_ptr_dtor(trace);
+    ZVAL_COPY_VALUE(trace, &merged);
+
+    return true;
+}
+
+/*
+ * Merges shadow frames into a newly-created exception's trace.
+ */
+static void tco_merge_exception_trace(zend_object *exception)
+{
+    zval trace;
+    zval rv;
+
+    zend_class_entry *base = instanceof_function(exception->ce, zend_ce_exception)
+        ? zend_ce_exception
+        : zend_ce_error;
+
+    if (
+        !tco_shadow.count
+        || !EG(current_execute_data)
+    ) {
+        return;
+    }
+
+    ZVAL_COPY(&trace, zend_read_property_ex(base, exception, ZSTR_KNOWN(ZEND_STR_TRACE), 1, &rv));
+
+    if (tco_merge_shadow_frames(&trace, EG(current_execute_data))) {
+        zend_update_property_ex(base, exception, ZSTR_KNOWN(ZEND_STR_TRACE), &trace);
+    }
+
+    zval_ptr_dtor(&trace);
+}
+
+/*
+ * Replacement create_object handlers for exceptions & errors (the trace is
+ * built when the object's created, so that's when the frames get merged).
+ */
+static zend_object *tco_exception_new(zend_class_entry *class_type)
+{
+    zend_object *exception = tco_previous_exception_new(class_type);
+
+    tco_merge_exception_trace(exception);
+
+    return exception;
+}
+
+static zend_object *tco_error_exception_new(zend_class_entry *class_type)
+{
+    zend_object *exception = tco_previous_error_exception_new(class_type);
+
+    tco_merge_exception_trace(exception);
+
+    return exception;
+}
+
+/*
+ * Replacement for debug_backtrace().
+ */
+static ZEND_NAMED_FUNCTION(tco_debug_backtrace)
+{
+    tco_previous_debug_backtrace(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+
+    tco_merge_shadow_frames(return_value, execute_data);
+}
+
+/*
+ * Hooks the shadow frames into debug_backtrace() & exception traces.
+ */
+static void tco_shadow_startup(void)
+{
+    zend_class_entry *ce;
+    zend_function *function;
+
+    tco_previous_exception_new = zend_ce_exception->create_object;
+    tco_previous_error_exception_new = zend_ce_error_exception->create_object;
+
+    // Every exception class registered so far has inherited one or the other.
+    // (Anything declared later will inherit ours.)
+
+    ZEND_HASH_FOREACH_PTR(CG(class_table), ce) {
+        if (ce->create_object == tco_previous_error_exception_new) {
+            ce->create_object = tco_error_exception_new;
+        } else if (ce->create_object == tco_previous_exception_new) {
+            ce->create_object = tco_exception_new;
+        }
+    } ZEND_HASH_FOREACH_END();
+
+    function = zend_hash_str_find_ptr(CG(function_table), "debug_backtrace", sizeof("debug_backtrace") - 1);
+
+    if (function && (function->type == ZEND_INTERNAL_FUNCTION)) {
+        tco_previous_debug_backtrace = function->internal_function.handler;
+        function->internal_function.handler = tco_debug_backtrace;
+    }
+}
+
+/*
+ * Determines whether a given op array can be rewritten lazily (tiered mode)
+ * - and if so, takes a snapshot of its opcodes & leaves it alone for now.
+ *
+ * Returns true if there's nothing more to be done with the op array at
+ * compile time (either it's been deferred, or it has no recursive calls).
+ */
+bool tco_tier_op_array(zend_op_array *op_array)
+{
+    bool has_recursive_call = false;
+
+    /*
+     * OPcache keeps op arrays in shared memory - so they can't be swapped out
+     * later. Closures & trait methods get copied around, so we'd only ever
+     * be swapping one of the copies - as do inherited methods with static
+     * variables (at least on PHP 8.0). (These all get rewritten straight away.)
+     */
+
+    if (CG(compiler_options) & ZEND_COMPILE_DELAYED_BINDING) {
+        return false;
+    }
+
+    if (
+        (op_array->fn_flags & (ZEND_ACC_CLOSURE | ZEND_ACC_GENERATOR))
+        || (op_array->scope && (op_array->scope->ce_flags & ZEND_ACC_TRAIT))
+        || op_array->static_variables
+        || (op_array->last_try_catch > 0)
+        || tco_wants_explicit_stack(op_array)
+    ) {
+        return false;
+    }
+
+    /*
+     * This is the only (cheap) scan done at compile time - just enough to
+     * know whether the function might be worth rewriting later.
+     */
+
+    for (uint32_t i = 0; i < op_array->last; i++) {
+        switch (op_array->opcodes[i].opcode) {
+            case ZEND_SWITCH_LONG:
+            case ZEND_SWITCH_STRING:
+            case ZEND_MATCH:
+                // Jump tables live in the literals, which pass two updates in
+                // place - so these can't go through it a second time.
+
+                return false;
+
+            case ZEND_GOTO:
+                // Pass two resolves labels from the compiler's context - which
+                // is long gone by the time the function gets hot.
+
+                return false;
+
+            case ZEND_INIT_METHOD_CALL:
             case ZEND_INIT_STATIC_METHOD_CALL:
             case ZEND_INIT_FCALL:
             case ZEND_INIT_FCALL_BY_NAME:
-                if (search_state == TCO_STATE_SEEKING_INIT) {
-                    // Found a tail call; now determine whether it's a recursive call.
-
-                    if (tco_is_call_recursive(op_array, op)) {
-                        // If so, run analysis on / optimisation of the call.
+                if (tco_is_call_recursive(op_array, &op_array->opcodes[i])) {
+                    has_recursive_call = true;
+                } else if (
+                    (TCO_INLINE_MAX_OPS > 0)
+                    && tco_find_inline_callee(op_array, &op_array->opcodes[i])
+                ) {
+                    // Inlining can only be done at compile time (see tco_tier_up).
 
-                        tco_optimise_recursive_call(context, i, return_index);
-                    }
+                    return false;
                 }
 
-                // Either way, reset the search state to look for returns.
+                break;
+        }
+    }
 
-                search_state = TCO_STATE_SEEKING_RETURN;
+    // If there's nothing recursive, there's nothing to do - now or later.
 
-                break;
+    if (!has_recursive_call) {
+        return true;
+    }
 
-            default:
-                /*
-                 * If we're here, the current opcode is neither a return,
-                 * a call or an init.
-                 *
-                 * If the current search state is TCO_STATE_SEEKING_CALL, we need
-                 * to reset to TCO_STATE_SEEKING_RETURN (because this means we found
-                 * a return, but no immediate call i.e. this cannot be a tail call).
-                 */
+    /*
+     * The rewrite happens as the last invocation returns - & that frame's
+     * CVs get freed by the op array's CV count afterwards, so the count can't
+     * change then. Any CV the rewrite might want has to be added now.
+     */
 
-                if (search_state == TCO_STATE_SEEKING_CALL) {
-                    search_state = TCO_STATE_SEEKING_RETURN;
-                }
+    if (TCO_SHADOW_FRAMES > 0) {
+        tco_add_cv(op_array, zend_string_init(TCO_SHADOW_CV_NAME, sizeof(TCO_SHADOW_CV_NAME) - 1, 0));
+    }
+
+    // Keep a copy of the opcodes as they are now (i.e. before pass two).
+
+    tco_tier *tier = emalloc(sizeof(tco_tier));
+
+    tier->opcodes = emalloc(sizeof(zend_op) * op_array->last);
+    tier->last = op_array->last;
+    tier->T = op_array->T;
+    tier->calls = 0;
+    tier->depth = 0;
+    tier->max_depth = 0;
+    tier->retired_opcodes = NULL;
+    tier->retired_live_range = NULL;
+
+    memcpy(tier->opcodes, op_array->opcodes, sizeof(zend_op) * op_array->last);
+
+    op_array->reserved[tco_resource_handle] = tier;
+
+    return true;
+}
+
+/*
+ * Rewrites a (now hot) op array from its snapshot & swaps in the new opcodes.
+ *
+ * This is only ever done when no invocations of the function are active, so
+ * nothing is left executing the old opcodes.
+ */
+void tco_tier_up(zend_op_array *op_array, tco_tier *tier)
+{
+    /*
+     * The analysis works on opcodes as they were before pass two - so we'll
+     * run it over a copy of the op array pointing at the snapshot.
+     */
+
+    zend_op_array snapshot = *op_array;
+
+    snapshot.opcodes = tier->opcodes;
+    snapshot.last = tier->last;
+    snapshot.T = tier->T;
+    snapshot.live_range = NULL;
+    snapshot.last_live_range = 0;
+
+#if !ZEND_USE_ABS_CONST_ADDR
+    /*
+     * Pass two moves the literals in alongside the opcodes (& frees wherever
+     * they were) - but the live op array's literals are already in with its
+     * opcodes. So the snapshot gets a copy of its own to move. (The values
+     * themselves are just moved along, rather than copied.)
+     */
+
+    if (snapshot.last_literal > 0) {
+        snapshot.literals = emalloc(sizeof(zval) * snapshot.last_literal);
+
+        memcpy(snapshot.literals, op_array->literals, sizeof(zval) * snapshot.last_literal);
+    }
+#endif
+
+    tier->opcodes = NULL;
+
+    tco_context *context = tco_new_context(&snapshot);
+
+    /*
+     * Inlining adds literals, which the snapshot can share with the live op
+     * array. (Besides, by now the function table has everything in it - not
+     * just what was known when this was compiled.)
+     */
+
+    context->inline_calls = false;
+
+    tco_analyse(context);
+
+    /*
+     * The CVs were all reserved up front (see tco_tier_op_array) - so there
+     * shouldn't be any new ones. If there are, the rewrite has to go: the
+     * frame on its way out is yet to free its CVs by the current count.
+     */
+
+    op_array->vars = snapshot.vars;
+
+    if (snapshot.last_var != op_array->last_var) {
+        while (snapshot.last_var > op_array->last_var) {
+            zend_string_release(snapshot.vars[--snapshot.last_var]);
+        }
+
+        context->do_compile = false;
+    }
+
+    if (!context->do_compile) {
+        // (Nothing could be optimised after all.)
+
+#if !ZEND_USE_ABS_CONST_ADDR
+        if (snapshot.last_literal > 0) {
+            efree(snapshot.literals);
         }
-    };
+#endif
+
+        efree(snapshot.opcodes);
+        tco_free_context(context);
+
+        return;
+    }
+
+    tco_compile_opcodes(context);
+    tco_free_context(context);
+
+    /*
+     * Now it needs to go through pass two, same as it would've at compile
+     * time. Pass two looks at the compiler's context, so that needs to match
+     * the op array (otherwise it'll start reallocating things) - and we don't
+     * want our own op array handler getting called again.
+     *
+     * Otherwise, pass two only needs the compiler for a few things - none of
+     * which get this far: goto labels (see tco_tier_op_array), finally blocks
+     * (there's no try) & generator returns (generators are left alone).
+     */
+
+    zend_oparray_context saved_context = CG(context);
+    uint32_t saved_options = CG(compiler_options);
+
+    CG(context).opcodes_size = snapshot.last;
+    CG(context).vars_size = snapshot.last_var;
+    CG(context).literals_size = snapshot.last_literal;
+    CG(compiler_options) &= ~(ZEND_COMPILE_HANDLE_OP_ARRAY | ZEND_COMPILE_EXTENDED_STMT);
+
+    pass_two(&snapshot);
+
+    CG(context) = saved_context;
+    CG(compiler_options) = saved_options;
+
+    // The old opcodes are kept until the op array is destroyed - just in case
+    // anything's still holding a pointer to them.
+
+    tier->retired_opcodes = op_array->opcodes;
+    tier->retired_live_range = op_array->live_range;
+
+    op_array->opcodes = snapshot.opcodes;
+    op_array->literals = snapshot.literals;
+    op_array->last = snapshot.last;
+    op_array->T = snapshot.T;
+    op_array->live_range = snapshot.live_range;
+    op_array->last_live_range = snapshot.last_live_range;
+}
+
+/*
+ * Observer "begin" handler - counts calls & recursion depth.
+ */
+static void tco_tier_begin(zend_execute_data *execute_data)
+{
+    tco_tier *tier = EX(func)->op_array.reserved[tco_resource_handle];
+
+    if (!tier || !tier->opcodes) {
+        return;
+    }
+
+    ++tier->calls;
+
+    if (++tier->depth > tier->max_depth) {
+        tier->max_depth = tier->depth;
+    }
+}
+
+/*
+ * Observer "end" handler - rewrites the function once it's hot & the last
+ * active invocation of it is on its way out.
+ */
+static void tco_tier_end(zend_execute_data *execute_data, zval *return_value)
+{
+    tco_tier *tier = EX(func)->op_array.reserved[tco_resource_handle];
+
+    if (!tier || !tier->opcodes) {
+        return;
+    }
+
+    if (
+        (--tier->depth == 0)
+        && (
+            (tier->calls >= TCO_TIER_CALLS)
+            || (tier->max_depth >= TCO_TIER_DEPTH)
+        )
+    ) {
+        tco_tier_up(&EX(func)->op_array, tier);
+    }
+}
+
+/*
+ * Decides (once per function) whether it needs observing.
+ */
+static zend_observer_fcall_handlers tco_tier_observer_init(zend_execute_data *execute_data)
+{
+    zend_function *func = EX(func);
+
+    if (
+        (func->type == ZEND_USER_FUNCTION)
+        && func->op_array.reserved[tco_resource_handle]
+    ) {
+        return (zend_observer_fcall_handlers) {tco_tier_begin, tco_tier_end};
+    }
+
+    return (zend_observer_fcall_handlers) {NULL, NULL};
+}
+
+/*
+ * Returns the current compilation unit's context, made ready for a given op
+ * array. (The context is only created for the first op array in the unit
+ * that needs one - after that, it's just reset.)
+ */
+static tco_context *tco_get_unit_context(zend_op_array *op_array)
+{
+    if (!tco_current_unit.context) {
+        tco_current_unit.context = tco_new_context(op_array);
+    } else {
+        tco_reset_context(tco_current_unit.context, op_array);
+    }
+
+    return tco_current_unit.context;
+}
+
+/*
+ * Called once the outermost file being compiled is done with.
+ */
+static void tco_end_unit(void)
+{
+    if (tco_current_unit.context) {
+        tco_free_context(tco_current_unit.context);
+    }
+
+    zend_hash_destroy(&tco_current_unit.inline_checks);
+
+    tco_current_unit.context = NULL;
+}
+
+/*
+ * Compiles a file - as a single unit. Every op array in the file (& in any
+ * files compiled while it's being compiled) gets analysed with the same
+ * context, so scratch memory & lookups aren't repeated for each one.
+ */
+static zend_op_array *tco_compile_file(zend_file_handle *file_handle, int type)
+{
+    zend_op_array *op_array = NULL;
+
+    bool bailed_out = false;
+
+    if (tco_current_unit.depth++ == 0) {
+        zend_hash_init(&tco_current_unit.inline_checks, 8, NULL, NULL, 0);
+
+        tco_current_unit.context = NULL;
+    }
+
+    zend_try {
+        op_array = tco_previous_compile_file(file_handle, type);
+    } zend_catch {
+        bailed_out = true;
+    } zend_end_try();
+
+    if (--tco_current_unit.depth == 0) {
+        tco_end_unit();
+    }
+
+    // (Compile errors bail out - which needs passing on once we've cleaned up.)
+
+    if (bailed_out) {
+        zend_bailout();
+    }
+
+    return op_array;
 }
 
 /*
@@ -751,15 +4409,27 @@ void tco_analyse(tco_context *context)
  */
 static void tco_op_handler(zend_op_array *op_array)
 {
+    tco_context *context;
+
     // If this array has no name, we ain't interested.
 
     if (!op_array->function_name) {
         return;
     }
 
-    // Create a context for this instance.
+    // In tiered mode, the rewrite may be left until the function is hot.
 
-    tco_context *context = tco_new_context(op_array);
+    if ((TCO_TIER_CALLS > 0) && tco_tier_op_array(op_array)) {
+        return;
+    }
+
+    // Use the compilation unit's context if there is one (else create one for this instance).
+
+    if (tco_current_unit.depth > 0) {
+        context = tco_get_unit_context(op_array);
+    } else {
+        context = tco_new_context(op_array);
+    }
 
     // Run the analysis to look for recursive calls, etc.
 
@@ -769,11 +4439,50 @@ static void tco_op_handler(zend_op_array *op_array)
 
     if (context->do_compile) {
         tco_compile_opcodes(context);
+
+        if (context->stack_cv) {
+            tco_compile_frame_returns(context);
+        }
     }
 
-    // (We're finished here.)
+    // (We're finished here - unless the context belongs to the unit.)
 
-    tco_free_context(context);
+    if (tco_current_unit.depth == 0) {
+        tco_free_context(context);
+    }
+}
+
+/*
+ * Called once, when the extension is loaded.
+ */
+static int tco_extension_startup(zend_extension *extension)
+{
+    // Take over ZEND_TICKS (keeping hold of any existing handler) - if anything needs it.
+
+    if (TCO_USES_TICKS) {
+        tco_previous_ticks_handler = zend_get_user_opcode_handler(ZEND_TICKS);
+
+        zend_set_user_opcode_handler(ZEND_TICKS, tco_ticks_handler);
+    }
+
+    // Tiered mode needs a slot in each op array & a way of counting calls.
+
+    if (TCO_TIER_CALLS > 0) {
+        tco_resource_handle = zend_get_resource_handle(extension->name);
+
+        zend_observer_fcall_register(tco_tier_observer_init);
+    }
+
+    if (TCO_SHADOW_FRAMES > 0) {
+        tco_shadow_startup();
+    }
+
+    // Wrap file compilation, so each file's op arrays can share a context.
+
+    tco_previous_compile_file = zend_compile_file;
+    zend_compile_file = tco_compile_file;
+
+    return SUCCESS;
 }
 
 /*
@@ -781,7 +4490,102 @@ static void tco_op_handler(zend_op_array *op_array)
  */
 static void tco_startup(void)
 {
-    // (Bootstrap code can go here.)
+    // Every request starts with an empty explicit stack (& no shadow frames).
+
+    memset(&tco_frames, 0x00, sizeof(tco_frame_stack));
+    memset(&tco_shadow, 0x00, sizeof(tco_shadow_ring));
+
+    tco_fiber_frames = NULL;
+}
+
+/*
+ * Empties a given stack & frees its memory.
+ */
+static void tco_release_frames(tco_frame_stack *stack)
+{
+    tco_truncate_frames(stack, 0);
+
+    if (stack->frames) {
+        efree(stack->frames);
+    }
+
+    if (stack->slots) {
+        efree(stack->slots);
+        efree(stack->slot_kinds);
+    }
+
+    memset(stack, 0x00, sizeof(tco_frame_stack));
+}
+
+/*
+ * Called at the end of each request.
+ */
+static void tco_shutdown(void)
+{
+    // Release anything still sitting on the explicit stacks (e.g. after an exception).
+
+    tco_frame_stack *stack;
+
+    if (tco_fiber_frames) {
+        ZEND_HASH_FOREACH_PTR(tco_fiber_frames, stack) {
+            tco_release_frames(stack);
+
+            efree(stack);
+        } ZEND_HASH_FOREACH_END();
+
+        zend_hash_destroy(tco_fiber_frames);
+        FREE_HASHTABLE(tco_fiber_frames);
+
+        tco_fiber_frames = NULL;
+    }
+
+    tco_release_frames(&tco_frames);
+
+    // Same goes for the shadow frames.
+
+    if (tco_shadow.frames) {
+        for (uint32_t i = 0; i < TCO_SHADOW_FRAMES; i++) {
+            tco_release_shadow_frame(&tco_shadow.frames[i]);
+        }
+
+        efree(tco_shadow.frames);
+    }
+
+    memset(&tco_shadow, 0x00, sizeof(tco_shadow_ring));
+}
+
+/*
+ * Called whenever an op array is destroyed.
+ */
+static void tco_op_array_dtor(zend_op_array *op_array)
+{
+    // Free anything tiered mode was keeping hold of.
+
+    if (tco_resource_handle < 0) {
+        return;
+    }
+
+    tco_tier *tier = op_array->reserved[tco_resource_handle];
+
+    if (!tier) {
+        return;
+    }
+
+    if (tier->opcodes) {
+        efree(tier->opcodes);
+    }
+
+    if (tier->retired_opcodes) {
+        efree(tier->retired_opcodes);
+    }
+
+    if (tier->retired_live_range) {
+        efree(tier->retired_live_range);
+    }
+
+    efree(tier);
+
+    op_array->reserved[tco_resource_handle] = NULL;
 }
 
 /* Zend extension jazz */
@@ -792,17 +4596,17 @@ ZEND_EXT_API zend_extension zend_extension_entry = {
     "Terence C.",
     NULL,
     NULL,
-    NULL,
+    tco_extension_startup,
     NULL,
     tco_startup, // tco_startup,
-    NULL,
+    tco_shutdown,
     NULL,
     tco_op_handler,
     NULL,
     NULL,
     NULL,
     NULL,
-    NULL,
+    tco_op_array_dtor,
     STANDARD_ZEND_EXTENSION_PROPERTIES
 };
 
@@ -7,31 +7,282 @@
 
 #define TCO_CALL_POOL_SIZE 8
 
+/*
+ * Small functions called in tail position (e.g. return $this->helper($x)) get
+ * inlined, provided they have no more than this many opcodes in their body.
+ * (Set to 0 to turn inlining off.)
+ */
+
+#ifndef TCO_INLINE_MAX_OPS
+    #define TCO_INLINE_MAX_OPS 16
+#endif
+
+/*
+ * Setting TCO_EXPLICIT_STACK above 0 (e.g. CFLAGS="-DTCO_EXPLICIT_STACK=1")
+ * builds in the explicit stack (see TCO_EXPLICIT_STACK_ATTRIBUTE). Without it,
+ * the attribute is ignored.
+ */
+
+#ifndef TCO_EXPLICIT_STACK
+    #define TCO_EXPLICIT_STACK 0
+#endif
+
+/*
+ * Functions carrying this attribute (e.g. #[TailCallExplicitStack]) opt in to
+ * having their non-tail recursive calls rewritten to use an explicit stack.
+ * (The name needs to be lowercase - that's how Zend stores attribute names.)
+ */
+
+#define TCO_EXPLICIT_STACK_ATTRIBUTE "tailcallexplicitstack"
+
+/*
+ * The explicit stack needs somewhere to keep track of how deep the current
+ * invocation is - so a hidden CV is added to the function with this name.
+ * (The dot means it can never clash with a real variable.)
+ */
+
+#define TCO_STACK_CV_NAME "tco.depth"
+
+/*
+ * Initial number of frames the explicit stack can hold before it needs to
+ * grow. (The stack doubles in size whenever it runs out of room.)
+ */
+
+#define TCO_FRAME_POOL_SIZE 64
+
+/*
+ * Setting TCO_TIER_CALLS above 0 (e.g. CFLAGS="-DTCO_TIER_CALLS=1000") turns on
+ * tiered mode: functions are no longer rewritten as soon as they're compiled.
+ * Instead, they're left alone until they've been called this many times - or
+ * have recursed TCO_TIER_DEPTH calls deep - and then rewritten on-the-fly.
+ */
+
+#ifndef TCO_TIER_CALLS
+    #define TCO_TIER_CALLS 0
+#endif
+
+#ifndef TCO_TIER_DEPTH
+    #define TCO_TIER_DEPTH 64
+#endif
+
+/*
+ * Setting TCO_SHARED_REENTRY_SITES above 0 changes how functions with at least
+ * that many recursive calls are laid out: rather than each call assigning
+ * every argument itself, calls only copy the values they change into T vars
+ * & jump to a single block which assigns them all & jumps back to the start.
+ */
+
+#ifndef TCO_SHARED_REENTRY_SITES
+    #define TCO_SHARED_REENTRY_SITES 0
+#endif
+
+/* (Marks an argument that isn't part of the shared re-entry block.) */
+
+#define TCO_NO_STAGE ((uint32_t) -1)
+
+/*
+ * Setting TCO_SHADOW_FRAMES above 0 (e.g. CFLAGS="-DTCO_SHADOW_FRAMES=16") keeps
+ * a record of the last N iterations of any rewritten recursion in the
+ * request - the line each recursive call was made from, plus (up to
+ * TCO_SHADOW_ARGS of) the arguments - which then shows up as extra frames in
+ * debug_backtrace() & exception traces. (Never set TCO_SHADOW_ARGS below 1.)
+ */
+
+#ifndef TCO_SHADOW_FRAMES
+    #define TCO_SHADOW_FRAMES 0
+#endif
+
+#ifndef TCO_SHADOW_ARGS
+    #define TCO_SHADOW_ARGS 4
+#endif
+
+/*
+ * Strings are recorded as the first TCO_SHADOW_STRING_LEN bytes (plus "..."
+ * if there were more) - matching how much of them traces print by default.
+ */
+
+#ifndef TCO_SHADOW_STRING_LEN
+    #define TCO_SHADOW_STRING_LEN 15
+#endif
+
+/*
+ * Each invocation recording shadow frames gets a serial number (so frames left
+ * behind by one that's finished can't be mistaken for a new one's), which is
+ * kept in a hidden CV with this name.
+ */
+
+#define TCO_SHADOW_CV_NAME "tco.shadow"
+
+/*
+ * The explicit stack is driven by a couple of "virtual" opcodes. Rather than
+ * inventing brand new opcodes, we hijack ZEND_TICKS (which is only emitted
+ * for declare(ticks=N)) and tell ours apart by these extended values.
+ */
+
+#define TCO_OPLINE_PUSH_FRAME   0x7C000001
+#define TCO_OPLINE_POP_FRAME    0x7C000002
+#define TCO_OPLINE_SHADOW_FRAME 0x7C000003
+
+/*
+ * OPcache's JIT won't run at all while a user opcode handler is registered -
+ * so ours is only registered if something built in actually needs it.
+ */
+
+#define TCO_USES_TICKS ((TCO_EXPLICIT_STACK > 0) || (TCO_SHADOW_FRAMES > 0))
+
 /* Some variables/types/etc. */
 
 typedef struct _tco_call_meta {
     uint16_t number;
+    uint32_t init_index;
     uint32_t *arg_mapping;
+    zend_uchar *arg_types;
+    zend_uchar *arg_moves;
+    uint32_t *arg_stages;
+    uint32_t move_count;
+    zend_op *inline_ops;
+    uint32_t inline_count;
     uint32_t spare_start_index;
     uint32_t spare_last_index;
+    uint32_t reentry_jump;
+    bool push_frame;
+    uint32_t frame_layout;
+    zend_uchar result_type;
+    uint32_t result_var;
     struct _tco_call_meta *previous;
 } tco_call_meta;
 
+typedef struct _tco_call_site {
+    uint32_t init_index;
+    uint32_t call_index;
+    uint32_t last_index;
+    bool push_frame;
+    uint32_t frame_layout;
+    zend_op_array *callee;
+} tco_call_site;
+
 typedef struct _tco_context {
     bool do_compile;
     zend_op_array *op_array;
     uint32_t *t_remaps;
+    uint32_t t_remaps_count;
+    bool t_remaps_reserved;
+    tco_call_site *call_sites;
+    uint32_t call_sites_size;
+    uint32_t *open_inits;
+    uint32_t open_inits_size;
     uint32_t start_address;
+    tco_call_meta *call_meta_pool;
     tco_call_meta *call_meta_tail;
     uint32_t total_extra_ops;
+    uint32_t stack_cv;
+    bool inline_calls;
+    uint32_t *reentry_stages;
+    uint32_t *reentry_holds;
+    uint32_t reentry_count;
+    uint32_t reentry_address;
+    tco_call_meta *reentry_host;
+    uint32_t shadow_cv;
 } tco_context;
 
+typedef struct _tco_unit {
+    uint32_t depth;
+    tco_context *context;
+    HashTable inline_checks;
+} tco_unit;
+
+typedef struct _tco_frame {
+    zend_execute_data *owner;
+    const uint32_t *layout;
+    uint32_t resume_index;
+    zend_uchar result_type;
+    uint32_t result_var;
+    bool is_first;
+    uint32_t slots_start;
+    uint32_t slot_count;
+    uint32_t dead_count;
+} tco_frame;
+
+typedef struct _tco_frame_stack {
+    tco_frame *frames;
+    uint32_t top;
+    uint32_t size;
+    zval *slots;
+    zend_uchar *slot_kinds;
+    uint32_t slots_top;
+    uint32_t slots_size;
+} tco_frame_stack;
+
+typedef struct _tco_shadow_frame {
+    zend_execute_data *owner;
+    zend_long serial;
+    uint32_t lineno;
+    uint32_t num_args;
+    zval args[TCO_SHADOW_ARGS];
+    char strings[TCO_SHADOW_ARGS][TCO_SHADOW_STRING_LEN + 3];
+    uint32_t string_lens[TCO_SHADOW_ARGS];
+} tco_shadow_frame;
+
+typedef struct _tco_shadow_ring {
+    tco_shadow_frame *frames;
+    uint32_t next;
+    uint32_t count;
+    zend_long serial;
+} tco_shadow_ring;
+
+typedef struct _tco_tier {
+    zend_op *opcodes;
+    uint32_t last;
+    uint32_t T;
+    uint32_t calls;
+    uint32_t depth;
+    uint32_t max_depth;
+    zend_op *retired_opcodes;
+    zend_live_range *retired_live_range;
+} tco_tier;
+
+/*
+ * How each argument gets its new value for the next iteration.
+ */
+
+enum {
+    TCO_MOVE_DEFAULT,   // Not passed; assign the default value.
+    TCO_MOVE_ASSIGN,    // Assign straight from whatever was passed.
+    TCO_MOVE_NONE,      // Passed itself (e.g. f($acc) for $acc); nothing to do.
+    TCO_MOVE_STAGED,    // Passed another argument that'll be overwritten first; copy it to a T var beforehand.
+};
+
+/*
+ * What a push frame does with each variable, according to its layout (see
+ * tco_plan_frame_layout). Only variables still needed after the call get a
+ * slot in the frame.
+ */
+
 enum {
-    TCO_STATE_SEEKING_RETURN,
-    TCO_STATE_SEEKING_CALL,
-    TCO_STATE_SEEKING_INIT,
+    TCO_SLOT_CV,        // A CV used after the call; moved into the frame & back.
+    TCO_SLOT_TMP,       // A T var holding a value across the call; moved into the frame & back.
+    TCO_SLOT_LOOP,      // Same, but for a foreach - which may have an iterator to let go of.
+    TCO_SLOT_RAW,       // Same, but for something that's never released (e.g. a class).
+    TCO_SLOT_DEAD_CV,   // A CV that isn't used after the call; released, rather than saved.
 };
 
+/*
+ * A layout is kept in a string literal: the resume address, the number of
+ * slots & dead CVs, then 1 entry per slot followed by 1 per dead CV. Each
+ * entry is the CV (or T var) number, with the kind in the lowest bits.
+ */
+
+#define TCO_LAYOUT_HEADER 3
+#define TCO_SLOT_KIND_BITS 3
+
+#define TCO_SLOT_ENTRY(num, kind) (((num) << TCO_SLOT_KIND_BITS) | (kind))
+#define TCO_SLOT_NUM(entry) ((entry) >> TCO_SLOT_KIND_BITS)
+#define TCO_SLOT_KIND(entry) ((entry) & ((1 << TCO_SLOT_KIND_BITS) - 1))
+
+/* (Marks a call site that can't use the explicit stack after all.) */
+
+#define TCO_NO_LAYOUT ((uint32_t) -1)
+
 /* This macro just helps look up the recv opcode from a given argument # */
 
 #define TCO_ARG_RECV_OPCODE(op_array, arg_index) op_array->opcodes[arg_index]
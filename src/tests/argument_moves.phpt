@@ -0,0 +1,45 @@
+--TEST--
+Arguments are moved into place without losing or sharing values
+--FILE--
+<?php
+
+function collect($rest, $acc = []) {
+    if (!$rest) {
+        return $acc;
+    }
+
+    $acc[] = array_pop($rest) * 2;
+
+    return collect($rest, $acc);
+}
+
+function swap($a, $b, $n) {
+    if ($n === 0) {
+        return [$a, $b];
+    }
+
+    return swap($b, $a, $n - 1);
+}
+
+function join_down($n, $s = '') {
+    if ($n === 0) {
+        return $s;
+    }
+
+    $t = $s . $n;
+
+    return join_down($n - 1, $t);
+}
+
+$input = range(1, 5);
+
+echo implode(',', collect($input)), "\n";
+echo count($input), "\n";
+echo implode(',', swap('x', 'y', 3)), "\n";
+echo join_down(3), "\n";
+?>
+--EXPECT--
+10,8,6,4,2
+5
+y,x
+321
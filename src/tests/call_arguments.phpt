@@ -0,0 +1,53 @@
+--TEST--
+Calls among the arguments, by-reference & maybe-by-reference sends
+--FILE--
+<?php
+
+function plus($a, $b) {
+    return $a + $b;
+}
+
+function add($n, $total = 0) {
+    if ($n === 0) {
+        return $total;
+    }
+
+    return add($n - 1, plus($total, max($n, 0)));
+}
+
+function fill(&$out, $n) {
+    if ($n === 0) {
+        return null;
+    }
+
+    $out[] = $n;
+
+    return fill($out, $n - 1);
+}
+
+class ListNode {
+    public function __construct(public $value, public $next = null) {}
+}
+
+class Walker {
+    public function last($node) {
+        if ($node->next === null) {
+            return $node->value;
+        }
+
+        return $this->last($node->next);
+    }
+}
+
+echo add(10), "\n";
+
+$out = [];
+fill($out, 3);
+
+echo implode(',', $out), "\n";
+echo (new Walker)->last(new ListNode(1, new ListNode(2, new ListNode(3)))), "\n";
+?>
+--EXPECT--
+55
+3,2,1
+3
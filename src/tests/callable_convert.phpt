@@ -0,0 +1,35 @@
+--TEST--
+First-class callable syntax ahead of a tail call
+--SKIPIF--
+<?php if (PHP_VERSION_ID < 80100) die('skip PHP 8.1+ only'); ?>
+--FILE--
+<?php
+
+function dive($n) {
+    $reverse = strrev(...);
+
+    if ($n === 0) {
+        throw new Exception($reverse('mottob'));
+    }
+
+    return dive($n - 1);
+}
+
+// (The first call is just to get past tiered mode, if it's built in.)
+
+for ($i = 0; $i < 2; $i++) {
+    try {
+        dive(($i === 0) ? 100 : 10000);
+    } catch (Exception $e) {
+        $message = $e->getMessage();
+        $depth = count($e->getTrace());
+    }
+}
+
+echo $message, "\n";
+
+var_dump($depth < 100);
+?>
+--EXPECT--
+bottom
+bool(true)
@@ -0,0 +1,97 @@
+--TEST--
+Non-tail recursion in functions opting in to the explicit stack
+--FILE--
+<?php
+
+class Node {
+    public function __construct(public $value, public $left = null, public $right = null) {}
+}
+
+function build($depth) {
+    if ($depth === 0) {
+        return null;
+    }
+
+    return new Node($depth, build($depth - 1), build($depth - 1));
+}
+
+#[TailCallExplicitStack]
+function sum($node) {
+    if ($node === null) {
+        return 0;
+    }
+
+    return $node->value + sum($node->left) + sum($node->right);
+}
+
+#[TailCallExplicitStack]
+function length($node) {
+    if ($node === null) {
+        return 0;
+    }
+
+    return 1 + length($node->left);
+}
+
+#[TailCallExplicitStack]
+function flatten($items) {
+    $out = [];
+
+    foreach ($items as $item) {
+        if (is_array($item)) {
+            foreach (flatten($item) as $value) {
+                $out[] = $value;
+            }
+        } else {
+            $out[] = $item;
+        }
+    }
+
+    return $out;
+}
+
+#[TailCallExplicitStack]
+function find($node, $value) {
+    if ($node === null) {
+        return 0;
+    }
+
+    if ($node->value === $value) {
+        throw new Exception("found $value");
+    }
+
+    return 1 + find($node->left, $value);
+}
+
+$list = null;
+
+for ($i = 0; $i < 50000; $i++) {
+    $list = new Node($i, $list);
+}
+
+echo sum(build(10)), "\n";
+echo length($list), "\n";
+echo implode(',', flatten([1, [2, [3, 4]], 5])), "\n";
+
+// Frames left behind by an exception mustn't get in the way of later calls.
+
+for ($i = 0; $i < 3; $i++) {
+    try {
+        find($list, 100 * $i);
+    } catch (Exception $e) {
+        echo $e->getMessage(), "\n";
+    }
+}
+
+echo length($list), "\n";
+echo sum(build(5)), "\n";
+?>
+--EXPECT--
+2036
+50000
+1,2,3,4,5
+found 0
+found 100
+found 200
+50000
+57
@@ -0,0 +1,51 @@
+--TEST--
+Recursive yield from in generators
+--FILE--
+<?php
+
+function walk_keyed($n) {
+    if ($n === 0) {
+        return;
+    }
+
+    yield $n => $n * 10;
+    yield from walk_keyed($n - 1);
+}
+
+function walk($n) {
+    if ($n === 0) {
+        return;
+    }
+
+    yield $n;
+    yield from walk($n - 1);
+}
+
+var_dump(iterator_to_array(walk_keyed(3)));
+
+// Each delegate's keys start from 0 again - so only the last value is left.
+
+var_dump(iterator_to_array(walk(3)));
+var_dump(iterator_to_array(walk(3), false));
+?>
+--EXPECT--
+array(3) {
+  [3]=>
+  int(30)
+  [2]=>
+  int(20)
+  [1]=>
+  int(10)
+}
+array(1) {
+  [0]=>
+  int(1)
+}
+array(3) {
+  [0]=>
+  int(3)
+  [1]=>
+  int(2)
+  [2]=>
+  int(1)
+}
@@ -0,0 +1,27 @@
+--TEST--
+Functions using goto
+--FILE--
+<?php
+
+function countdown($n, $acc = '') {
+    if ($n === 0) {
+        goto done;
+    }
+
+    return countdown($n - 1, $acc . $n);
+
+    done:
+
+    return $acc;
+}
+
+// (Enough calls to get it rewritten, if tiered mode is built in.)
+
+for ($i = 0; $i < 2000; $i++) {
+    $result = countdown(5);
+}
+
+var_dump($result);
+?>
+--EXPECT--
+string(5) "54321"
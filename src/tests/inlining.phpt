@@ -0,0 +1,40 @@
+--TEST--
+Small callees in tail position are inlined
+--FILE--
+<?php
+
+class Grid {
+    private function index($x, $y) {
+        return $y * 64 + $x;
+    }
+
+    public function at($x, $y) {
+        return $this->index($x, $y);
+    }
+}
+
+abstract class Shape {
+    abstract protected function area();
+
+    public function describe() {
+        return self::area();
+    }
+}
+
+class Square extends Shape {
+    protected function area() {
+        return 4;
+    }
+}
+
+var_dump((new Grid)->at(3, 2));
+
+try {
+    var_dump((new Square)->describe());
+} catch (Error $e) {
+    echo $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+int(131)
+Cannot call abstract method Shape::area()
@@ -0,0 +1,43 @@
+--TEST--
+Shadow frames show up in exception traces as if the calls really happened
+--SKIPIF--
+<?php
+function probe($n) {
+    if ($n === 0) {
+        throw new Exception;
+    }
+
+    return probe($n - 1);
+}
+
+try {
+    probe(3);
+} catch (Exception $e) {
+    if (count($e->getTrace()) < 4) {
+        die('skip not built with TCO_SHADOW_FRAMES');
+    }
+}
+?>
+--FILE--
+<?php
+
+function down($n, $s) {
+    if ($n === 0) {
+        throw new Exception('bottom');
+    }
+
+    return down($n - 1, $s . 'x');
+}
+
+try {
+    down(3, str_repeat('a', 20));
+} catch (Exception $e) {
+    echo $e->getTraceAsString(), "\n";
+}
+?>
+--EXPECTF--
+#0 %s(%d): down(0, 'aaaaaaaaaaaaaaa...')
+#1 %s(%d): down(1, 'aaaaaaaaaaaaaaa...')
+#2 %s(%d): down(2, 'aaaaaaaaaaaaaaa...')
+#3 %s(%d): down(3, 'aaaaaaaaaaaaaaa...')
+#4 {main}
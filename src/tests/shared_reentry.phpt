@@ -0,0 +1,43 @@
+--TEST--
+Functions with several recursive calls
+--FILE--
+<?php
+
+function collatz($n, $steps = 0) {
+    if ($n === 1) {
+        return $steps;
+    }
+
+    if ($n % 2 === 0) {
+        return collatz(intdiv($n, 2), $steps + 1);
+    }
+
+    if ($n % 3 === 0) {
+        return collatz(3 * $n + 1, $steps + 1);
+    }
+
+    return collatz(3 * $n + 1, $steps + 1);
+}
+
+function pick($n, $a, $b, $c) {
+    if ($n === 0) {
+        return "$a$b$c";
+    }
+
+    if ($n % 3 === 0) {
+        return pick($n - 1, $b, $c, $a);
+    }
+
+    if ($n % 3 === 1) {
+        return pick($n - 1, $c, $a, $b);
+    }
+
+    return pick($n - 1, $a, $c, $b);
+}
+
+echo collatz(27), "\n";
+echo pick(4, 'a', 'b', 'c'), "\n";
+?>
+--EXPECT--
+111
+bac
@@ -0,0 +1,40 @@
+--TEST--
+Recursive tail calls are turned into loops
+--FILE--
+<?php
+
+function count_up($n = 0) {
+    if ($n < 100000) {
+        return count_up($n + 1);
+    }
+
+    return $n;
+}
+
+function dive($n) {
+    if ($n === 0) {
+        throw new Exception('bottom');
+    }
+
+    return dive($n - 1);
+}
+
+var_dump(count_up());
+
+// (The first call is just to get past tiered mode, if it's built in.)
+
+for ($i = 0; $i < 2; $i++) {
+    try {
+        dive(($i === 0) ? 100 : 10000);
+    } catch (Exception $e) {
+        $depth = count($e->getTrace());
+    }
+}
+
+// Without the rewrite, there'd be a frame for every call.
+
+var_dump($depth < 100);
+?>
+--EXPECT--
+int(100000)
+bool(true)
@@ -0,0 +1,43 @@
+--TEST--
+Functions rewritten once hot behave the same as before
+--FILE--
+<?php
+
+class Base {
+    public function total($n, $acc = 0) {
+        static $calls = 0;
+
+        ++$calls;
+
+        if ($n === 0) {
+            return $acc;
+        }
+
+        return $this->total($n - 1, $acc + $n);
+    }
+}
+
+class Child extends Base {}
+
+function fib($n, $a = 0, $b = 1) {
+    if ($n === 0) {
+        return $a;
+    }
+
+    return fib($n - 1, $b, $a + $b);
+}
+
+// (Enough calls & depth to get everything rewritten, if tiered mode is built in.)
+
+for ($i = 0; $i < 2000; $i++) {
+    $fib = fib(50);
+    $base = (new Base)->total(100);
+    $child = (new Child)->total(100);
+}
+
+var_dump($fib, $base, $child);
+?>
+--EXPECT--
+int(12586269025)
+int(5050)
+int(5050)